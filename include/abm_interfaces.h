@@ -4,22 +4,51 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <utility>
+#include <stdint.h>
 
+#include "aligned_array.h"
+
+class ContentHash;
 class Sample;
+class RandomStream;
+class ScatteringTable;
+class ScatteringTableSet;
 
 class DataList {
     public:
         DataList();
         DataList(std::ifstream &input, unsigned int begin, unsigned int step);
+        /* Uses count values that outlive the list, e.g. in a mapped SpectralLibrary, without copying them */
+        DataList(const double *values, size_t count, unsigned int begin, unsigned int step);
         ~DataList();
 
         void adjustData(double multiplicationFactor);
         double lookup(int wavelength) const;
+        void addToHash(ContentHash &hash) const;
+
+        const double *values() const {
+            if(mapped != NULL) {
+                return mapped;
+            }
+            return data.empty() ? NULL : &data[0];
+        }
+        size_t size() const {
+            return mapped != NULL ? count : data.size();
+        }
+        unsigned int start() const {
+            return begin;
+        }
+        unsigned int spacing() const {
+            return step;
+        }
 
     private:
         unsigned int begin;
         unsigned int step;
         std::vector<double> data;
+        const double *mapped;   /* values not owned by the list, in place of data */
+        size_t count;
 };
 
 class ABMInterface {
@@ -34,7 +63,7 @@ class ABMInterface {
     double absorptionBelow;
     double thicknessAbove;
     double thicknessBelow;
-    std::string name;
+    const char *name;
 
     ABMInterface()  :
         nAbove(1.0),
@@ -54,33 +83,204 @@ class ABMInterface {
     friend std::ostream &operator<<(std::ostream&, const ABMInterface&);
 };
 
+/* Direction bits used to index InterfaceList::side */
+#define DIRECTION_DOWN 0 /* direction.z < 0 */
+#define DIRECTION_UP   1
+
+/*
+ * One interface as seen by a photon travelling in one direction, with every
+ * field the tracer needs already selected for that direction. Padded to a
+ * cache line; names and other cold data stay in ABMInterface.
+ */
+struct InterfaceSide {
+    double n1;
+    double n2;
+    double perturbanceReflect;
+    double perturbanceRefract;
+    double thickness;
+    double absorption;
+    int reflectState;
+    int refractState;
+} __attribute__((aligned(64)));
+
+/* Most per-sample geometry parameters an InterfaceList may have */
+#define MAX_SAMPLE_PARAMETERS 8
+
+/*
+ * Supplies the per-sample geometry parameters of an InterfaceList in place of
+ * independent uniforms, e.g. to spread them evenly over a run's photons. Each
+ * parameter must still be uniform on [0,1) for any one photon.
+ */
+class SampleParameterSampler {
+    public:
+        virtual ~SampleParameterSampler() {
+        }
+        /* Fills u[0, numParameters) for the photon whose substream rng is on */
+        virtual void draw(RandomStream &rng, int numParameters, double *u) const = 0;
+};
+
 class InterfaceList {
     public:
-        virtual void prepareForSample() = 0;
-        ABMInterface getInterface(int index) const {
+        InterfaceList() : parameterSampler(NULL) {
+        }
+        virtual ~InterfaceList() {
+        }
+        /* Draws the per-sample geometry from the parameter sampler, or from rng when there is none */
+        virtual void prepareForSample(RandomStream &rng);
+
+        /* Per-sample geometry as a function of numSampleParameters() uniforms in [0,1), which
+           prepareForSample draws; lets callers integrate over it instead of sampling it */
+        virtual int numSampleParameters() const {
+            return 0;
+        }
+        virtual void setSampleParameters(const double *u) {
+        }
+        /* prepareForSample takes the parameters from sampler; NULL draws them from the photon's stream */
+        void setParameterSampler(const SampleParameterSampler *sampler) {
+            parameterSampler = sampler;
+        }
+
+        const ABMInterface &getInterface(int index) const {
             return interfaces[index];
         }
+        const InterfaceSide &side(int index, int direction) const {
+            return sides[2*index + direction];
+        }
+        const InterfaceSide *sideTable() const {
+            return &sides[0];
+        }
         size_t size() const {
             return interfaces.size();
         }
+
+        /* Table for sampling Brakke scattering of perturbance delta, or NULL to sample it exactly */
+        const ScatteringTable *scatteringTable(double delta) const {
+            for(size_t i = 0; i < scatteringTables.size(); i++) {
+                if(scatteringTables[i].first == delta) {
+                    return scatteringTables[i].second;
+                }
+            }
+            return NULL;
+        }
+        void useScatteringTables(ScatteringTableSet &tables);
     protected:
+        /* Builds the side table from interfaces; subclasses call this once the list is complete */
+        void buildSides();
+
+        /* Per-sample geometry changes go through these so both views stay in step */
+        void setThicknessAbove(int index, double thickness) {
+            interfaces[index].thicknessAbove = thickness;
+            sides[2*index + DIRECTION_DOWN].thickness = thickness;
+        }
+        void setThicknessBelow(int index, double thickness) {
+            interfaces[index].thicknessBelow = thickness;
+            sides[2*index + DIRECTION_UP].thickness = thickness;
+        }
+
         std::vector<ABMInterface> interfaces;
+        std::vector<InterfaceSide> sides;
+        std::vector<std::pair<double, const ScatteringTable *> > scatteringTables;
+        const SampleParameterSampler *parameterSampler;
 };
 
 
+/* Mesophyll absorbers, in the order ABMInterfaceListBuilder::mesophyllAbsorptionGradient reports them */
+enum Absorber {
+    ABSORBER_CHLOROPHYLL_A,
+    ABSORBER_CHLOROPHYLL_B,
+    ABSORBER_CAROTENOID,
+    ABSORBER_PROTEIN,
+    ABSORBER_CELLULOSE,
+    ABSORBER_LIGNIN,
+    ABSORBER_WATER,
+    NUM_ABSORBERS
+};
+
+extern const char *absorberNames[NUM_ABSORBERS];
+
+/*
+ * Everything buildInterfaces reads from the spectral data, for one sample at
+ * each wavelength of a run, one aligned array per coefficient. Tabulating it
+ * up front keeps the data lookups, and their clamping warnings, out of worker
+ * threads, which only index into it.
+ */
+struct SpectralCoefficients {
+    std::vector<int> wavelengths;
+    AlignedArray mesophyllAbsorption;   /* 1/m */
+    AlignedArray cuticleRI;
+    AlignedArray mesophyllRI;
+    AlignedArray antidermalRI;
+
+    size_t size() const {
+        return wavelengths.size();
+    }
+};
+
 class ABMInterfaceListBuilder {
     public:
-        ABMInterfaceListBuilder() {
+        ABMInterfaceListBuilder() : scatteringTables(NULL) {
         }
         ABMInterfaceListBuilder(const std::string &dataDirectory);
+        virtual ~ABMInterfaceListBuilder() {
+        }
         virtual InterfaceList *buildInterfaces(const Sample &sample, int wavelength);
+        /* As above, but with every absorbing layer's coefficient replaced by mesophyllAbsorption */
+        InterfaceList *buildInterfaces(const Sample &sample, int wavelength, double mesophyllAbsorption);
+        /* As above at table.wavelengths[index], from coefficients tabulate has already looked up */
+        InterfaceList *buildInterfaces(const Sample &sample, const SpectralCoefficients &table, size_t index);
+        InterfaceList *buildInterfaces(const Sample &sample, const SpectralCoefficients &table, size_t index,
+                double mesophyllAbsorption);
+        /* As the two above, but refill list in place when it isn't NULL, so that a worker keeping one
+           list allocates nothing past its first task; list must have been built by this builder */
+        void rebuildInterfaces(InterfaceList *&list, const Sample &sample, const SpectralCoefficients &table,
+                size_t index);
+        void rebuildInterfaces(InterfaceList *&list, const Sample &sample, const SpectralCoefficients &table,
+                size_t index, double mesophyllAbsorption);
+        /* Fills table with the sample's coefficients at each of wavelengths */
+        void tabulate(const Sample &sample, const std::vector<int> &wavelengths, SpectralCoefficients &table) const;
+        /* Absorption coefficient (1/m) of the mesophyll built from the sample's concentrations */
+        double mesophyllAbsorption(const Sample &sample, int wavelength) const;
+        /* Derivative of mesophyllAbsorption by each absorber's concentration (g/cm^3); water has no
+           concentration, so its entry is per unit scaling of the water absorption */
+        void mesophyllAbsorptionGradient(int wavelength, double gradient[NUM_ABSORBERS]) const;
+
+        /* Names the model the built lists belong to */
+        virtual const char *modelName() const {
+            return "abm";
+        }
+        /* Hash of the spectral data as read, so results can be tied to the data that produced them */
+        uint64_t dataChecksum() const;
+        /* Writes the spectral data as read to a SpectralLibrary file, which later builders map instead */
+        bool writeLibrary(const std::string &filename) const;
+        /* Levels of the scattering tables in use, 0 when scattering is sampled exactly */
+        int scatteringLevels() const;
+
+        /* Built lists sample scattering from these tables instead of exactly; NULL restores exact sampling */
+        void setScatteringTables(ScatteringTableSet *tables) {
+            scatteringTables = tables;
+        }
 
     protected:
         virtual void readAllData(const std::string &dataDirectory);
         virtual void readData(std::string filename, DataList &dlist);
+        /* Takes every spectrum from the library in dataDirectory if it is there and newer than the text files */
+        bool readLibrary(const std::string &dataDirectory);
+        /* The spectra below, in the order spectral libraries and readAllData list them */
+        DataList *spectrumList(int index);
+        const DataList *spectrumList(int index) const {
+            return const_cast<ABMInterfaceListBuilder *>(this)->spectrumList(index);
+        }
         virtual InterfaceList *createInterfaceList(const Sample &sample, double airRI, 
                 double cuticleRI, double mesophyllRI, double antidermalRI,
                 double mesophyllAbsorption, double mesophyllThickness);
+        /* Refills a list createInterfaceList made as if it had made it with these arguments */
+        virtual void refillInterfaceList(InterfaceList &list, const Sample &sample, double airRI,
+                double cuticleRI, double mesophyllRI, double antidermalRI,
+                double mesophyllAbsorption, double mesophyllThickness);
+        /* Builds a list from coefficients already looked up, or refills list when it isn't NULL;
+           every buildInterfaces ends here */
+        InterfaceList *assembleInterfaces(InterfaceList *list, const Sample &sample, double cuticleRI,
+                double mesophyllRI, double antidermalRI, double mesophyllAbsorption);
 
         std::string dataDirectory;
         DataList carotenoidAbsorption;
@@ -91,6 +291,7 @@ class ABMInterfaceListBuilder {
         DataList mesophyllRefractiveIndex;
         DataList cuticleRefractiveIndex;
         DataList antidermalRefractiveIndex;
+        ScatteringTableSet *scatteringTables;
 };
 
 #endif
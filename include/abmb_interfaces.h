@@ -1,5 +1,5 @@
-#ifndef __ABMU_INTERFACES_H
-#define __ABMU_INTERFACES_H
+#ifndef __ABMB_INTERFACES_H
+#define __ABMB_INTERFACES_H
 
 #include "abm_interfaces.h"
 
@@ -7,7 +7,9 @@ class ABMBInterfaceList : public InterfaceList {
     public:
         ABMBInterfaceList(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI, double
                 antidermalRI, double mesophyllAbsorption, double mesophyllThickness);
-        virtual void prepareForSample();
+        /* Rebuilds the list in place, as the constructor would build it */
+        void assign(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI, double
+                antidermalRI, double mesophyllAbsorption, double mesophyllThickness);
     private:
         double airRI;
         double cuticleRI;
@@ -20,10 +22,18 @@ class ABMBInterfaceList : public InterfaceList {
 class ABMBInterfaceListBuilder : public ABMInterfaceListBuilder {
     public:
         ABMBInterfaceListBuilder(const std::string &dataDirectory);
+        /* Shares the spectra already read by another builder */
+        ABMBInterfaceListBuilder(const ABMInterfaceListBuilder &data);
+        virtual const char *modelName() const {
+            return "abmb";
+        }
     protected:
         virtual InterfaceList *createInterfaceList(const Sample &sample, double airRI, 
                 double cuticleRI, double mesophyllRI, double antidermalRI,
                 double mesophyllAbsorption, double mesophyllThickness);
+        virtual void refillInterfaceList(InterfaceList &list, const Sample &sample, double airRI,
+                double cuticleRI, double mesophyllRI, double antidermalRI,
+                double mesophyllAbsorption, double mesophyllThickness);
 };
 
 #endif
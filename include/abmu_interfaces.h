@@ -7,7 +7,14 @@ class ABMUInterfaceList : public InterfaceList {
     public:
         ABMUInterfaceList(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI, double
                 antidermalRI, double mesophyllAbsorption, double mesophyllThickness);
-        virtual void prepareForSample();
+        /* Rebuilds the list in place, as the constructor would build it */
+        void assign(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI, double
+                antidermalRI, double mesophyllAbsorption, double mesophyllThickness);
+        /* The single parameter is the fraction of the mesophyll above its air gap */
+        virtual int numSampleParameters() const {
+            return 1;
+        }
+        virtual void setSampleParameters(const double *u);
 
     private:
         double airRI;
@@ -21,10 +28,18 @@ class ABMUInterfaceList : public InterfaceList {
 class ABMUInterfaceListBuilder : public ABMInterfaceListBuilder {
     public:
         ABMUInterfaceListBuilder(const std::string &dataDirectory);
+        /* Shares the spectra already read by another builder */
+        ABMUInterfaceListBuilder(const ABMInterfaceListBuilder &data);
+        virtual const char *modelName() const {
+            return "abmu";
+        }
     protected:
         virtual InterfaceList *createInterfaceList(const Sample &sample, double airRI, 
                 double cuticleRI, double mesophyllRI, double antidermalRI,
                 double mesophyllAbsorption, double mesophyllThickness);
+        virtual void refillInterfaceList(InterfaceList &list, const Sample &sample, double airRI,
+                double cuticleRI, double mesophyllRI, double antidermalRI,
+                double mesophyllAbsorption, double mesophyllThickness);
 };
 
 #endif
@@ -0,0 +1,73 @@
+#ifndef __ALIGNED_ARRAY_H
+#define __ALIGNED_ARRAY_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+/*
+ * Fixed-size array of doubles that starts on a cache line, so a pass over
+ * several of them vectorizes without peeling, and a worker reading one
+ * element never shares its line with another array. Resizing discards the
+ * contents.
+ */
+class AlignedArray {
+    public:
+        AlignedArray() : data(NULL), count(0) {
+        }
+        AlignedArray(const AlignedArray &other) : data(NULL), count(0) {
+            *this = other;
+        }
+        ~AlignedArray() {
+            free(data);
+        }
+        AlignedArray &operator=(const AlignedArray &other) {
+            if(this != &other) {
+                resize(other.count);
+                if(count > 0) {
+                    memcpy(data, other.data, count * sizeof(double));
+                }
+            }
+            return *this;
+        }
+
+        void resize(size_t n) {
+            if(n == count) {
+                return;
+            }
+            free(data);
+            data = NULL;
+            count = 0;
+            if(n > 0) {
+                void *memory;
+                if(posix_memalign(&memory, 64, n * sizeof(double)) != 0) {
+                    throw std::bad_alloc();
+                }
+                data = static_cast<double *>(memory);
+                count = n;
+            }
+        }
+
+        double &operator[](size_t index) {
+            return data[index];
+        }
+        const double &operator[](size_t index) const {
+            return data[index];
+        }
+        double *values() {
+            return data;
+        }
+        const double *values() const {
+            return data;
+        }
+        size_t size() const {
+            return count;
+        }
+
+    private:
+        double *data;
+        size_t count;
+};
+
+#endif
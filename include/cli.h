@@ -0,0 +1,9 @@
+#ifndef __CLI_H
+#define __CLI_H
+
+#include "simulator.h"
+
+/* Parses the abmu/abmb command line, runs the model and writes the CSV; returns the exit status */
+int runCommandLine(int argc, char *argv[], ModelType model);
+
+#endif
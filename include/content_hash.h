@@ -0,0 +1,38 @@
+#ifndef __CONTENT_HASH_H
+#define __CONTENT_HASH_H
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+/* 64-bit FNV-1a over the bytes fed to it; used to key cached results by their inputs */
+class ContentHash {
+    public:
+        ContentHash() : value(14695981039346656037ULL) {
+        }
+
+        void add(const void *bytes, size_t length) {
+            const unsigned char *p = (const unsigned char *)bytes;
+            for(size_t i = 0; i < length; i++) {
+                value = (value ^ p[i]) * 1099511628211ULL;
+            }
+        }
+        void add(double x) {
+            add(&x, sizeof(x));
+        }
+        void add(uint64_t x) {
+            add(&x, sizeof(x));
+        }
+        void add(const char *text) {
+            add(text, strlen(text) + 1);
+        }
+
+        uint64_t get() const {
+            return value;
+        }
+
+    private:
+        uint64_t value;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef __EXECUTOR_H
+#define __EXECUTOR_H
+
+#include <cstddef>
+#include <vector>
+#include <pthread.h>
+
+/* A batch of numbered tasks run by an Executor */
+class ExecutorJob {
+    public:
+        virtual ~ExecutorJob() {
+        }
+        virtual void runTask(size_t taskIndex, int workerIndex) = 0;
+};
+
+/*
+ * Pool of worker threads that stays alive between runs. Each run hands the
+ * task indices out round-robin to per-worker deques; a worker pops its own
+ * deque from the bottom and, once empty, steals from the top of the others
+ * (Chase & Lev, SPAA'05). Taking a task never takes a lock, and no task is
+ * added while a run is in progress.
+ */
+class Executor {
+    public:
+        /* numThreads <= 0 starts one worker per online processor */
+        Executor(int numThreads);
+        ~Executor();
+
+        /* Runs tasks 0..numTasks-1 on the workers and blocks until they have all finished.
+           Runs started from different threads take turns. */
+        void run(ExecutorJob &job, size_t numTasks);
+
+        int size() const {
+            return numThreads;
+        }
+
+        static int detectProcessors();
+
+    private:
+        struct WorkDeque {
+            std::vector<size_t> tasks;
+            char padTop[64];
+            long top;
+            char padBottom[64];
+            long bottom;
+            char padEnd[64];
+        };
+
+        Executor(const Executor &);
+        Executor &operator=(const Executor &);
+
+        static void *workerMain(void *arg);
+        void workerLoop(int workerIndex);
+        void work(int workerIndex);
+        bool pop(WorkDeque &deque, size_t &taskIndex);
+        int steal(WorkDeque &deque, size_t &taskIndex);
+
+        int numThreads;
+        pthread_t *threads;
+        WorkDeque *deques;
+
+        pthread_mutex_t runMutex;
+        pthread_mutex_t mutex;
+        pthread_cond_t startCondition;
+        pthread_cond_t doneCondition;
+        unsigned long generation;
+        int busyWorkers;
+        bool shuttingDown;
+        ExecutorJob *job;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __INVERSION_H
+#define __INVERSION_H
+
+#include <cstdio>
+#include <vector>
+
+#include "sample.h"
+#include "simulator.h"
+
+/* A Sample field the fit may change, kept within [lower, upper] */
+struct FreeParameter {
+    const char *name;       /* the field's key in sample json */
+    double Sample::*field;
+    double lower;
+    double upper;
+};
+
+/* Parses "<key>:<lower>:<upper>", where key is any numeric field of sample json */
+bool parseFreeParameter(const char *spec, FreeParameter &parameter);
+/* Numeric fields of sample json, NULL-terminated, in the order writeSample writes them */
+extern const FreeParameter sampleFields[];
+/* Writes a sample as json that parseSampleFromFile reads back */
+void writeSample(FILE *outputFile, const Sample &sample);
+
+/* Reflectance and transmittance measured at some wavelengths */
+struct MeasuredSpectrum {
+    std::vector<int> wavelengths;
+    std::vector<double> reflectance;
+    std::vector<double> transmittance;
+};
+
+/* Reads "wavelength, reflectance, transmittance[, ...]" rows, as the models write them; lines that
+   don't start with a number (headers) are skipped, and so are any further columns */
+bool readMeasuredSpectrum(FILE *inputFile, MeasuredSpectrum &spectrum);
+
+struct InversionSettings {
+    int initialSamples; /* samples per wavelength of the first iterations */
+    int maxIterations;
+    double tolerance;   /* relative decrease in the misfit below which an iteration counts as converged */
+    bool pathLengths;   /* evaluate candidates from paths traced once per sample count; concentrations only */
+
+    InversionSettings() :
+        initialSamples(2000),
+        maxIterations(100),
+        tolerance(1e-3),
+        pathLengths(false)
+    {
+    }
+};
+
+struct InversionResult {
+    Sample sample;
+    double misfit;      /* root mean square of the R and T residuals */
+    int iterations;
+    int numSamples;     /* samples per wavelength of the final evaluation */
+};
+
+/*
+ * Fits the free parameters of initial to a measured spectrum by bounded
+ * Levenberg-Marquardt. Every evaluation uses settings.seed, so candidates are
+ * compared on the same photons and the finite-difference Jacobian isn't
+ * swamped by Monte Carlo noise. Fits start with initialSamples photons per
+ * wavelength and double them each time the fit stops improving, up to
+ * settings.numSamples. Progress goes to stderr.
+ */
+InversionResult invertSpectrum(Simulator &simulator, ModelType model, const Sample &initial,
+        const std::vector<FreeParameter> &parameters, const MeasuredSpectrum &measured,
+        const SpectrumSettings &settings, const InversionSettings &inversion);
+
+#endif
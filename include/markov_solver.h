@@ -0,0 +1,45 @@
+#ifndef __MARKOV_SOLVER_H
+#define __MARKOV_SOLVER_H
+
+#include <map>
+#include <pthread.h>
+
+#include "run_abm.h"
+
+class InterfaceList;
+class BrakkeKernel;
+
+/*
+ * Deterministic counterpart of runABM. Every interface normal is +-z, so a
+ * photon is a Markov chain on (interface, direction, cos(theta)); splitting
+ * cos(theta) into bins makes it a finite absorbing chain whose reflectance
+ * and transmittance come out of one linear solve instead of a photon count.
+ * Per-sample geometry (ABM-U's mesophyll split) is integrated by Gauss-Legendre
+ * quadrature. The error shrinks with the bin count; Brakke redistribution
+ * kernels depend only on the perturbance and are shared between solves, so
+ * one solver can serve every worker.
+ */
+class MarkovSolver {
+    public:
+        MarkovSolver(int bins);
+        ~MarkovSolver();
+
+        ReflectPair solve(double azimuthalAngle, double polarAngle, bool disableSieve, InterfaceList &interfaceList);
+
+        int getBins() const {
+            return bins;
+        }
+
+    private:
+        MarkovSolver(const MarkovSolver &);
+        MarkovSolver &operator=(const MarkovSolver &);
+
+        /* Redistribution of perturbance delta, or NULL for an unperturbed interface */
+        const BrakkeKernel *kernel(double delta);
+
+        int bins;
+        std::map<double, BrakkeKernel *> kernels;
+        pthread_mutex_t mutex;
+};
+
+#endif
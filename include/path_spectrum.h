@@ -0,0 +1,64 @@
+#ifndef __PATH_SPECTRUM_H
+#define __PATH_SPECTRUM_H
+
+#include <vector>
+
+#include "run_abm.h"
+#include "spectrum.h"
+
+class ABMInterfaceListBuilder;
+class Executor;
+struct Sample;
+
+/*
+ * Absorption-free photons binned by where they left the leaf and by their
+ * optical depth per unit absorption coefficient, L = sum of thickness/cos
+ * over the absorbing layers crossed. Every absorbing layer of a model uses the
+ * same coefficient a, and a photon survives a crossing with probability
+ * exp(-a*thickness/cos), so reflectance at any a is E[weight * reflected * exp(-a*L)].
+ * Depths are binned logarithmically and each bin is evaluated at its
+ * weighted mean.
+ */
+class PathTally {
+    public:
+        PathTally();
+
+        void add(bool reflected, double depth, double weight = 1);
+        /* A photon that lost its roulette; it counts as absorbed at any coefficient */
+        void addTerminated() {
+            numTerminated++;
+        }
+        void add(const PathTally &other);
+
+        long numSamples() const;
+        ReflectPair evaluate(double absorptionCoefficient) const;
+        /* d/da of evaluate(a) */
+        ReflectPair evaluateDerivative(double absorptionCoefficient) const;
+
+    private:
+        static int bin(double depth);
+
+        std::vector<long> counts[2];  /* transmitted, reflected */
+        std::vector<double> weights[2];
+        std::vector<double> depths[2]; /* weighted sums */
+        long numTerminated;
+};
+
+struct PathPoint {
+    int wavelength;
+    PathTally tally;
+};
+
+/* Traces settings.numSamples absorption-free photons per wavelength through the sample's morphology;
+   wavelengths whose refractive indices are all the same share one set of paths */
+std::vector<PathPoint> tracePathSpectrum(Executor &executor, ABMInterfaceListBuilder &builder,
+        const Sample &sample, const SpectrumSettings &settings);
+
+/* Spectrum of a sample with the morphology the paths were traced for, at its own concentrations */
+std::vector<SpectrumPoint> evaluatePathSpectrum(const ABMInterfaceListBuilder &builder, const Sample &sample,
+        const std::vector<PathPoint> &paths);
+
+/* Whether two samples differ only in concentrations, so they can share traced paths */
+bool sameMorphology(const Sample &a, const Sample &b);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef __RANDOM_STREAM_H
+#define __RANDOM_STREAM_H
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "sobol.h"
+
+/* Philox4x32 round multipliers and Weyl key increments */
+#define PHILOX_M0 0xD2511F53UL
+#define PHILOX_M1 0xCD9E8D57UL
+#define PHILOX_W0 0x9E3779B9UL
+#define PHILOX_W1 0xBB67AE85UL
+#define PHILOX_ROUNDS 10
+
+/*
+ * Counter-based random number stream (Philox4x32-10, Salmon et al., SC'11).
+ *
+ * A stream is identified by a (seed, stream) pair and carries no state other
+ * than its counter, so every worker or task can own an independent stream
+ * without locking, and a run can be reproduced exactly from its seed. Each
+ * stream is further divided into 2^32 substreams (one per photon), so a
+ * range of photons can be traced by any task and still draw the same numbers.
+ *
+ * For randomized quasi-Monte Carlo, useSobol gives each substream a point of a
+ * scrambled Sobol sequence. Tracers ask for the coordinates of a photon's
+ * fixed sample dimensions through sample(), so each dimension always drives
+ * the same decision; uniform() still draws from Philox, for everything whose
+ * number of draws varies from photon to photon.
+ */
+class RandomStream {
+    public:
+        RandomStream(uint64_t seed = 0, uint64_t stream = 0, uint32_t substream = 0);
+
+        /* restarts the stream identified by (seed, stream) at the beginning of a substream */
+        void reset(uint64_t seed, uint64_t stream, uint32_t substream = 0);
+
+        /* serves sample() for this substream from point index of sequence, in Gray-code order,
+           and for each later substream from the next point */
+        void useSobol(const SobolSequence *sequence, uint32_t index) {
+            sobol = sequence;
+            sobolIndex = index;
+            sobol->grayPoint(index, sobolPoint);
+        }
+
+        /* the substream being drawn from, i.e. the photon's number */
+        uint32_t substream() const {
+            return counter[1];
+        }
+
+        /* Philox key and counter words, for generators that evaluate the same counters for
+           several photons at once: counter[0] is the block, counter[1] the substream and
+           counter[2..3] the stream */
+        uint32_t keyWord(int i) const {
+            return key[i];
+        }
+        uint32_t counterWord(int i) const {
+            return counter[i];
+        }
+
+        /* advances to the beginning of the next substream */
+        void nextSubstream() {
+            counter[0] = 0;
+            counter[1]++;
+            position = 4;
+            if(sobol != NULL) {
+                sobol->nextGrayPoint(++sobolIndex, sobolPoint);
+            }
+        }
+
+        /* the photon's coordinate in sample dimension dimension: that of its Sobol point under
+           useSobol, for the first SOBOL_DIMENSIONS dimensions, and otherwise the next uniform() */
+        double sample(int dimension) {
+            if(sobol == NULL || dimension >= SOBOL_DIMENSIONS) {
+                return uniform();
+            }
+            return sobol->scramble(sobolPoint[dimension], dimension);
+        }
+
+        /* The sequence sample() draws from, or NULL, and the photon's point of it as grayPoint
+           gives it, for generators that scramble several coordinates at once */
+        const SobolSequence *sobolSequence() const {
+            return sobol;
+        }
+        const uint32_t *sobolCoordinates() const {
+            return sobolPoint;
+        }
+
+        /* generates a random number on [0,1)-real-interval */
+        double uniform() {
+            if(position == 4) {
+                refill();
+            }
+            return buffer[position++] * (1.0 / 4294967296.0);
+        }
+
+    private:
+        void refill();
+
+        uint32_t key[2];
+        uint32_t counter[4];
+        uint32_t buffer[4];
+        int position;
+        const SobolSequence *sobol;   /* NULL when every draw comes from Philox */
+        uint32_t sobolIndex;
+        uint32_t sobolPoint[SOBOL_DIMENSIONS];  /* point sobolIndex of sobol, as grayPoint gives it */
+};
+
+#endif
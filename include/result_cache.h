@@ -0,0 +1,42 @@
+#ifndef __RESULT_CACHE_H
+#define __RESULT_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include "spectrum.h"
+
+class ABMInterfaceListBuilder;
+struct Sample;
+
+/*
+ * Directory of spectra tallied in earlier runs, one file per key. A key
+ * covers everything that decides which photons get traced (sample, model,
+ * spectral data, geometry, sieve, scattering tables and seed) but not the
+ * photon count, so a later run can keep tracing from where an earlier one
+ * stopped. Files are replaced by rename, so concurrent processes never see
+ * a partial file; when two of them store the same wavelength, the larger
+ * tally wins.
+ */
+class ResultCache {
+    public:
+        /* Creates the directory if it doesn't exist yet */
+        ResultCache(const std::string &directory);
+
+        std::string key(const Sample &sample, const ABMInterfaceListBuilder &builder,
+                const SpectrumSettings &settings) const;
+
+        /* Replaces the tally of every point of spectrum with the cached one for its wavelength, if any */
+        void load(const std::string &key, std::vector<SpectrumPoint> &spectrum) const;
+        /* Records the tallies of spectrum, keeping other wavelengths already cached under key */
+        void store(const std::string &key, const std::vector<SpectrumPoint> &spectrum);
+
+    private:
+        std::string filename(const std::string &key) const;
+        bool read(const std::string &filename, std::vector<SpectrumPoint> &entries) const;
+
+        std::string directory;
+        unsigned long numStores;
+};
+
+#endif
@@ -1,10 +1,274 @@
 #ifndef __RUN_ABM_H
 #define __RUN_ABM_H
 
+#include <algorithm>
+#include <cmath>
 #include <utility>
 
+#include "vector.h"
+
 typedef std::pair<double, double> ReflectPair;
 
-ReflectPair runABM(int nSamples, double azimuthalAngle, double polarAngle, bool inVitro, InterfaceList &interfaceList);
+class InterfaceList;
+class PathTally;
+class RandomStream;
+
+#define EVENT_BINS 32
+
+/* How many events (interface visits) photons took, in power-of-two bins */
+struct EventStats {
+    long counts[EVENT_BINS];  /* counts[k] photons took [2^k, 2^(k+1)) events; counts[0] also has 0 */
+    long numEvents;
+    long maxEvents;
+    long numRouletted;        /* photons that outlived the event limit and played roulette */
+
+    EventStats() : numEvents(0), maxEvents(0), numRouletted(0) {
+        for(int k = 0; k < EVENT_BINS; k++) {
+            counts[k] = 0;
+        }
+    }
+
+    void add(long events) {
+        int k = 0;
+        while(k < EVENT_BINS - 1 && (events >> (k + 1)) != 0) {
+            k++;
+        }
+        counts[k]++;
+        numEvents += events;
+        maxEvents = std::max(maxEvents, events);
+    }
+
+    void add(const EventStats &other) {
+        for(int k = 0; k < EVENT_BINS; k++) {
+            counts[k] += other.counts[k];
+        }
+        numEvents += other.numEvents;
+        maxEvents = std::max(maxEvents, other.maxEvents);
+        numRouletted += other.numRouletted;
+    }
+
+    long numPhotons() const {
+        long n = 0;
+        for(int k = 0; k < EVENT_BINS; k++) {
+            n += counts[k];
+        }
+        return n;
+    }
+
+    /* Upper end of the bin holding the q-th quantile of events per photon */
+    long quantileBound(double q) const {
+        const double target = q * numPhotons();
+        long seen = 0;
+        for(int k = 0; k < EVENT_BINS; k++) {
+            seen += counts[k];
+            if(seen >= target) {
+                return (2L << k) - 1;
+            }
+        }
+        return maxEvents;
+    }
+};
+
+/* Photon counts from one or more runs over the same wavelength */
+struct ReflectTally {
+    long numReflected;
+    long numTransmitted;
+    long numAbsorbed;
+    /* Summed over the photons that left, the depth of absorbing layers they crossed per unit
+       absorption coefficient (sum of thickness/cos), times the photon's weight if weighted;
+       minus this is each photon's score for it */
+    double reflectedDepth;
+    double transmittedDepth;
+    /* Every tracer sums each photon's weight as it leaves, and its square. Weights only
+       differ from 1 under implicit capture or once a photon has played roulette, which marks
+       the tally weighted; the counts then only say how many photons ended each way */
+    bool weighted;
+    double reflectedWeight;
+    double transmittedWeight;
+    double reflectedWeightSquares;
+    double transmittedWeightSquares;
+    EventStats events;        /* of the photons traced, not of any loaded from a cache */
+    /* Control variate: photons that reflect off the interface they start at leave on their
+       first event with weight 1, and Fresnel's equations give their expected fraction */
+    long numFirstReflected;
+    double firstSurfaceReflectance;
+
+    ReflectTally() : numReflected(0), numTransmitted(0), numAbsorbed(0), reflectedDepth(0), transmittedDepth(0),
+            weighted(false), reflectedWeight(0), transmittedWeight(0), reflectedWeightSquares(0),
+            transmittedWeightSquares(0), numFirstReflected(0), firstSurfaceReflectance(0) {
+    }
+
+    void addReflected(double weight, double depth, int events) {
+        numFirstReflected += events == 1;
+        numReflected++;
+        reflectedWeight += weight;
+        reflectedWeightSquares += weight*weight;
+        reflectedDepth += weight*depth;
+    }
+    void addTransmitted(double weight, double depth) {
+        numTransmitted++;
+        transmittedWeight += weight;
+        transmittedWeightSquares += weight*weight;
+        transmittedDepth += weight*depth;
+    }
+
+    void add(const ReflectTally &other) {
+        numReflected     += other.numReflected;
+        numTransmitted   += other.numTransmitted;
+        numAbsorbed      += other.numAbsorbed;
+        reflectedDepth   += other.reflectedDepth;
+        transmittedDepth += other.transmittedDepth;
+        weighted         = weighted || other.weighted;
+        reflectedWeight  += other.reflectedWeight;
+        transmittedWeight += other.transmittedWeight;
+        reflectedWeightSquares += other.reflectedWeightSquares;
+        transmittedWeightSquares += other.transmittedWeightSquares;
+        events.add(other.events);
+        numFirstReflected += other.numFirstReflected;
+        if(other.numSamples() > 0) {
+            firstSurfaceReflectance = other.firstSurfaceReflectance;
+        }
+    }
+
+    long numSamples() const {
+        return numReflected + numTransmitted + numAbsorbed;
+    }
+
+    ReflectPair pair() const {
+        const long n = numSamples();
+        if(weighted) {
+            return ReflectPair(reflectedWeight / n, transmittedWeight / n);
+        }
+        return ReflectPair((double)numReflected / n, (double)numTransmitted / n);
+    }
+
+    /* Binomial variance of one sample, with half a count added so empty tallies aren't certain;
+       weighted tallies use their sample variance, but no less than that of half a count */
+    double reflectanceVariance() const {
+        return weighted ? weightVariance(reflectedWeight, reflectedWeightSquares) :
+            countVariance(numReflected);
+    }
+    double transmittanceVariance() const {
+        return weighted ? weightVariance(transmittedWeight, transmittedWeightSquares) :
+            countVariance(numTransmitted);
+    }
+    double countVariance(long count) const {
+        const double p = (count + 0.5) / (numSamples() + 1);
+        return p * (1 - p);
+    }
+    double weightVariance(double weight, double weightSquares) const {
+        const double mean = weight / numSamples();
+        return std::max(weightSquares / numSamples() - mean*mean, countVariance(0));
+    }
+
+    /* dR/da and dT/da for the mesophyll absorption coefficient a, by likelihood ratio: a photon
+       that survived depth L had probability exp(-a*L) of doing so */
+    ReflectPair absorptionDerivative() const {
+        const long n = numSamples();
+        return ReflectPair((0.0 - reflectedDepth) / n, (0.0 - transmittedDepth) / n);
+    }
+
+    double reflectanceStderr() const {
+        return sqrt(reflectanceVariance() / numSamples());
+    }
+    double transmittanceStderr() const {
+        return sqrt(transmittanceVariance() / numSamples());
+    }
+
+    /* Regression coefficients of the photons' R and T scores on the control c (1 for photons
+       reflected on their first event): Cov(score, c) / Var(c), with c's score fixed at 1 and 0 */
+    ReflectPair controlCoefficients() const {
+        const double c = (double)numFirstReflected / numSamples();
+        if(c <= 0 || c >= 1) {
+            return ReflectPair(0, 0);
+        }
+        const ReflectPair rt = pair();
+        return ReflectPair((1 - rt.first) / (1 - c), (0.0 - rt.second) / (1 - c));
+    }
+    /* R and T less the fitted correction for the control's deviation from its expectation */
+    ReflectPair controlledPair() const {
+        const ReflectPair beta = controlCoefficients();
+        const double deviation = (double)numFirstReflected / numSamples() - firstSurfaceReflectance;
+        const ReflectPair rt = pair();
+        return ReflectPair(rt.first - beta.first * deviation, rt.second - beta.second * deviation);
+    }
+    /* Variance of one sample of controlledPair(): what the control doesn't explain */
+    double controlledReflectanceVariance() const {
+        return controlledVariance(reflectanceVariance(), controlCoefficients().first);
+    }
+    double controlledTransmittanceVariance() const {
+        return controlledVariance(transmittanceVariance(), controlCoefficients().second);
+    }
+    double controlledVariance(double variance, double beta) const {
+        const double c = (double)numFirstReflected / numSamples();
+        return std::max(variance - beta * beta * c * (1 - c), countVariance(0));
+    }
+};
+
+/* Where photons start and which states end them */
+struct StartingGeometry {
+    vec3 direction;
+    int startState;
+    int reflectedState;
+    int transmittedState;
+};
+
+StartingGeometry startingGeometry(double azimuthalAngle, double polarAngle, int numInterfaces);
+/* Chance that a photon reflects off the interface it starts at, which ends it on its first event */
+double firstSurfaceReflectance(const StartingGeometry &geometry, const InterfaceList &interfaceList);
+
+enum TracerMode {
+    TRACER_SCALAR, /* one photon at a time */
+    TRACER_PACKET, /* as TRACER_REDUCED, PACKET_WIDTH photons at a time in SIMD lanes */
+    TRACER_REDUCED, /* one photon at a time, carrying only the interface state and the direction's z */
+    TRACER_IMPLICIT /* as TRACER_REDUCED, but photons carry a weight in place of being absorbed */
+};
+
+/*
+ * Sample dimensions each event draws from RandomStream::sample, following the
+ * interface list's sample parameters: whether the photon is absorbed in the
+ * layer it crosses, whether it reflects, then the two draws of its scattering.
+ * Tracers that make no absorption draw leave that dimension unused. Rejected
+ * scattering attempts, roulettes and events past SOBOL_DIMENSIONS draw from
+ * Philox, so under --qmc each dimension always drives the same decision.
+ */
+#define EVENT_DIMENSIONS 4
+#define ABSORPTION_DIMENSION 0
+#define FRESNEL_DIMENSION 1
+#define SCATTERING_DIMENSION 2
+
+/* First sample dimension of a photon's events-th event */
+inline int eventDimension(int numParameters, int events) {
+    return numParameters + EVENT_DIMENSIONS * (events - 1);
+}
+
+/* Events a photon may take before it plays Russian roulette; 0 never */
+#define DEFAULT_ROULETTE_EVENTS 1000
+
+/* The tracers' event roulette for a photon beginning its events-th event; false when it ends the photon */
+bool surviveEventRoulette(int events, int rouletteEvents, double &weight, ReflectTally &tally, RandomStream &rng);
+
+/*
+ * Traces nSamples photons; photon i draws from the i-th substream following rng's current one.
+ * Photons that outlive rouletteEvents events, and then every rouletteEvents more, survive with
+ * probability 1/2 and double their weight, which keeps the tally unbiased and bounds the
+ * expected cost of every photon.
+ */
+ReflectTally runABM(int nSamples, double azimuthalAngle, double polarAngle, bool inVitro, InterfaceList &interfaceList,
+        RandomStream &rng, int rouletteEvents = DEFAULT_ROULETTE_EVENTS);
+ReflectTally runABMPacket(int nSamples, double azimuthalAngle, double polarAngle, bool inVitro, InterfaceList &interfaceList,
+        RandomStream &rng, int rouletteEvents = DEFAULT_ROULETTE_EVENTS);
+ReflectTally runABMReduced(int nSamples, double azimuthalAngle, double polarAngle, bool inVitro, InterfaceList &interfaceList,
+        RandomStream &rng, int rouletteEvents = DEFAULT_ROULETTE_EVENTS);
+ReflectTally runABMImplicit(int nSamples, double azimuthalAngle, double polarAngle, bool inVitro, InterfaceList &interfaceList,
+        RandomStream &rng, int rouletteEvents = DEFAULT_ROULETTE_EVENTS);
+
+/* Traces nSamples photons with absorption switched off, recording the optical depth and weight each one left with */
+PathTally runABMPaths(int nSamples, double azimuthalAngle, double polarAngle, bool inVitro, InterfaceList &interfaceList,
+        RandomStream &rng, int rouletteEvents = DEFAULT_ROULETTE_EVENTS);
+
+ReflectTally runTracer(TracerMode mode, int nSamples, double azimuthalAngle, double polarAngle, bool inVitro,
+        InterfaceList &interfaceList, RandomStream &rng, int rouletteEvents = DEFAULT_ROULETTE_EVENTS);
+bool parseTracerMode(const char *name, TracerMode &mode);
 
 #endif
@@ -4,4 +4,5 @@
 
 struct Sample;
 int parseSampleFromFile(struct Sample *sample, FILE *inputFile);
+int parseSampleFromString(struct Sample *sample, const char *text, size_t length);
 #endif
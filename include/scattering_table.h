@@ -0,0 +1,82 @@
+#ifndef __SCATTERING_TABLE_H
+#define __SCATTERING_TABLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+#include "vector.h"
+
+/*
+ * Orthonormal frame around a scattering axis w. e1 points from w towards the
+ * pole on w's side of the interface plane and e2 is horizontal, so a
+ * direction mu*w + sin(theta)*(cos(psi)*e1 + sin(psi)*e2) stays on w's side
+ * exactly when sin(theta)*cos(psi)*horizontal + mu*vertical >= 0.
+ */
+struct ScatteringFrame {
+    vec3 w;
+    vec3 e1;
+    vec3 e2;
+    double vertical;   /* |w.z| */
+    double horizontal; /* sqrt(1 - w.z^2) */
+
+    ScatteringFrame(const vec3 &w);
+
+    static double horizontalOf(double z) {
+        return sqrt(std::max(0.0, 1 - z*z));
+    }
+
+    vec3 direction(double mu, double sinTheta, double cosPsi, double sinPsi) const {
+        return e1 * (sinTheta*cosPsi) + e2 * (sinTheta*sinPsi) + w * mu;
+    }
+};
+
+/*
+ * Tabulated inverse CDF of the Brakke lobe cos(theta)^delta truncated to the
+ * incoming side of the interface, over a grid of axis elevations. Sampling
+ * interpolates the table and draws the azimuth directly on the allowed arc,
+ * so it never rejects; the interpolation error shrinks with the number of levels.
+ */
+class ScatteringTable {
+    public:
+        ScatteringTable(double delta, int levels);
+
+        /* A scattered direction from two uniforms */
+        vec3 sample(const ScatteringFrame &frame, double u, double v) const;
+        /* z of sample(ScatteringFrame(w), u, v) for any w with this z */
+        double sampleZ(double z, double u, double v) const;
+
+    private:
+        /* cos(theta) and the azimuth for an axis of the given elevation, from uniforms u and v */
+        void draw(double vertical, double horizontal, double u, double v, double &mu, double &sinTheta,
+                double &psi, double &cosPsi) const;
+
+        int levels;
+        /* (levels+1) rows of axis elevation by (levels+1) CDF levels: mu and its allowed azimuth fraction */
+        std::vector<float> inverse;
+        std::vector<float> arc;
+};
+
+/* Shared, lazily built tables keyed by perturbance. Tables are never freed before the set. */
+class ScatteringTableSet {
+    public:
+        ScatteringTableSet(int levels);
+        ~ScatteringTableSet();
+
+        const ScatteringTable *get(double delta);
+        int getLevels() const {
+            return levels;
+        }
+
+    private:
+        ScatteringTableSet(const ScatteringTableSet &);
+        ScatteringTableSet &operator=(const ScatteringTableSet &);
+
+        int levels;
+        std::map<double, ScatteringTable *> tables;
+        pthread_mutex_t mutex;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef __SIMULATOR_H
+#define __SIMULATOR_H
+
+#include <string>
+#include <vector>
+
+#include "abmb_interfaces.h"
+#include "abmu_interfaces.h"
+#include "executor.h"
+#include "path_spectrum.h"
+#include "result_cache.h"
+#include "scattering_table.h"
+#include "spectrum.h"
+
+enum ModelType {
+    MODEL_ABMU, /* unifacial leaves */
+    MODEL_ABMB  /* bifacial leaves */
+};
+
+/*
+ * In-process entry point to the models. The spectral data is read once when
+ * the simulator is created and the worker threads live as long as it does,
+ * so a simulation costs only its own tracing. simulate() may be called from
+ * any number of threads; concurrent calls take turns on the shared workers.
+ */
+class Simulator {
+    public:
+        /* numThreads <= 0 starts one worker per processor; scatteringLevels > 0 samples scattering from tables */
+        Simulator(const std::string &dataDirectory, int numThreads = 0, int scatteringLevels = 0);
+
+        std::vector<SpectrumPoint> simulate(const Sample &sample, ModelType model, const SpectrumSettings &settings);
+        /* Simulates many samples at once, handing each spectrum to sink as soon as it is done */
+        void simulateBatch(const std::vector<Sample> &samples, ModelType model, const SpectrumSettings &settings,
+                SpectrumSink &sink);
+
+        /* Absorption-free paths through the sample's morphology at every wavelength of settings */
+        std::vector<PathPoint> tracePaths(const Sample &sample, ModelType model, const SpectrumSettings &settings);
+        /* Spectrum of a sample sharing the morphology paths were traced for; takes microseconds per wavelength */
+        std::vector<SpectrumPoint> evaluatePaths(const Sample &sample, ModelType model, const std::vector<PathPoint> &paths);
+
+        /* Results are looked up in and added to cache from now on; NULL stops caching */
+        void setCache(ResultCache *cache) {
+            this->cache = cache;
+        }
+
+        /* d(mesophyll absorption)/d(concentration) of each absorber; see ABMInterfaceListBuilder */
+        void absorptionGradient(int wavelength, double gradient[NUM_ABSORBERS]) const {
+            abmuBuilder.mesophyllAbsorptionGradient(wavelength, gradient);
+        }
+
+        int numThreads() const {
+            return executor.size();
+        }
+
+    private:
+        Simulator(const Simulator &);
+        Simulator &operator=(const Simulator &);
+
+        ScatteringTableSet scatteringTables;
+        ABMUInterfaceListBuilder abmuBuilder;
+        ABMBInterfaceListBuilder abmbBuilder;
+        Executor executor;
+        ResultCache *cache;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __SOBOL_H
+#define __SOBOL_H
+
+#include <stdint.h>
+
+/* Dimensions of each Sobol point; RandomStream draws past these from Philox */
+#define SOBOL_DIMENSIONS 32
+
+/* Multipliers of the nested uniform scramble's hash */
+#define OWEN_M0 0x6C50B47CU
+#define OWEN_M1 0xB82F1E52U
+#define OWEN_M2 0xC7AFE638U
+#define OWEN_M3 0x8D22F6E6U
+
+/*
+ * One scramble of the Sobol sequence (Joe & Kuo direction numbers), with each
+ * dimension given a hash-based nested uniform (Owen) scramble (Burley, JCGT
+ * 2020). Every point of a scramble is uniform on [0,1)^d, so an estimate from
+ * one is unbiased, estimates from independently seeded scrambles are
+ * independent, and their spread measures the error of a randomized
+ * quasi-Monte Carlo estimate. Points are best used in runs of a power of two
+ * starting at index 0.
+ */
+class SobolSequence {
+    public:
+        /* Scramble number scramble of a (seed, stream) pair, as RandomStream identifies streams */
+        SobolSequence(uint64_t seed, uint64_t stream, uint32_t scramble);
+
+        /* coordinate dimension of point index, on [0,1) */
+        double sample(uint32_t index, int dimension) const;
+
+        /* Unscrambled coordinates of point index in Gray-code order, bit-reversed as scramble
+           takes them. An aligned run of a power of two indices gives the same points in either
+           order, and stepping to the next one costs one XOR per dimension */
+        void grayPoint(uint32_t index, uint32_t point[SOBOL_DIMENSIONS]) const;
+        /* Steps point from index - 1 to index in Gray-code order; index is never 0 */
+        void nextGrayPoint(uint32_t index, uint32_t point[SOBOL_DIMENSIONS]) const {
+            const uint32_t *v = grayDirections[__builtin_ctz(index)];
+            for(int d = 0; d < SOBOL_DIMENSIONS; d++) {
+                point[d] ^= v[d];
+            }
+        }
+        /* coordinate dimension of a grayPoint, scrambled, on [0,1) */
+        double scramble(uint32_t coordinate, int dimension) const;
+        /* scramble's seed for each dimension */
+        const uint32_t *seeds() const {
+            return scrambleSeeds;
+        }
+
+    private:
+        uint32_t scrambleSeeds[SOBOL_DIMENSIONS];
+
+        /* Shared by every scramble, so a sequence is only its seeds; filled before main */
+        static uint32_t directions[SOBOL_DIMENSIONS][32];
+        static uint32_t grayDirections[32][SOBOL_DIMENSIONS];    /* directions bit-reversed, by bit */
+        static bool directionsReady;
+        static bool fillDirections();
+};
+
+#endif
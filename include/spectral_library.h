@@ -0,0 +1,82 @@
+#ifndef __SPECTRAL_LIBRARY_H
+#define __SPECTRAL_LIBRARY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* Name of the library in a data directory; builders read it in place of the text files when it is current */
+#define SPECTRAL_LIBRARY_FILENAME "abm-spectra.bin"
+#define SPECTRAL_LIBRARY_MAGIC "ABMSPEC"
+#define SPECTRAL_LIBRARY_VERSION 1
+/* Written as is, so a file from a host of the other byte order reads back as something else */
+#define SPECTRAL_LIBRARY_BYTE_ORDER 0x01020304U
+
+/*
+ * Layout of a spectral library file: this header, a table naming each
+ * series, then every series' values as doubles, one series after another.
+ * All series share one wavelength grid. The checksum is a ContentHash of
+ * the table and the values.
+ */
+struct SpectralLibraryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t numSeries;
+    uint32_t count;     /* values per series */
+    uint32_t start;     /* nm */
+    uint32_t step;      /* nm */
+    uint64_t checksum;
+};
+
+struct SpectralLibraryEntry {
+    char name[24];
+    char units[8];      /* of the values as stored, i.e. as the builder uses them */
+};
+
+/* One series to write, or one found in a mapped library */
+struct SpectralSeries {
+    std::string name;
+    std::string units;
+    const double *values;
+};
+
+/*
+ * A library file mapped read-only into memory, so every process that opens
+ * it shares one copy in the page cache. Each file is mapped once per
+ * process, however many libraries open it. Series point straight into the
+ * mapping, which stays for the life of the process since data lists built
+ * on it may be copied anywhere.
+ */
+class SpectralLibrary {
+    public:
+        SpectralLibrary() : header(NULL) {
+        }
+
+        /* Maps and checks filename; false, after a warning unless the file is missing, when it can't be used */
+        bool open(const std::string &filename);
+
+        /* Values of the series called name, or NULL if the library has none */
+        const double *find(const std::string &name) const;
+
+        uint32_t start() const {
+            return header->start;
+        }
+        uint32_t step() const {
+            return header->step;
+        }
+        uint32_t count() const {
+            return header->count;
+        }
+
+    private:
+        const SpectralLibraryHeader *header;
+        std::vector<SpectralSeries> series;
+};
+
+/* Writes series of count values each, on the grid start, start+step, ..., by rename so readers never see half a file */
+bool writeSpectralLibrary(const std::string &filename, const std::vector<SpectralSeries> &series,
+        uint32_t count, uint32_t start, uint32_t step);
+
+#endif
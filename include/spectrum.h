@@ -0,0 +1,132 @@
+#ifndef __SPECTRUM_H
+#define __SPECTRUM_H
+
+#include <cmath>
+#include <vector>
+#include <stdint.h>
+
+#include "run_abm.h"
+
+class ABMInterfaceListBuilder;
+class Executor;
+class ResultCache;
+struct Sample;
+
+enum SolverType {
+    SOLVER_MONTE_CARLO,   /* trace photons */
+    SOLVER_DETERMINISTIC  /* solve the binned Markov chain; see MarkovSolver */
+};
+
+/* How to simulate a spectrum; the defaults match the command line defaults */
+struct SpectrumSettings {
+    int wavelengthStart;
+    int wavelengthEnd;
+    int step;
+    int numSamples;      /* samples per wavelength, or the most to spend on one with targetStderr */
+    int chunkSize;       /* samples per task, 0 to pick one that keeps every worker busy */
+    double targetStderr; /* keep adding samples until R and T reach this standard error, 0 to disable */
+    unsigned long seed;
+    double azimuthalAngle;
+    double polarAngle;
+    bool disableSieve;
+    TracerMode tracer;
+    SolverType solver;
+    int solverBins;      /* cos(theta) bins of the deterministic solver */
+    bool jacobian;       /* have the deterministic solver find absorption derivatives too */
+    bool verbose;        /* report each wavelength of single-sample runs on stderr */
+    bool reportSchedule; /* report how each round's predicted task costs matched on stderr */
+    bool commonRandomNumbers; /* photon i draws the same numbers at every wavelength */
+    int rouletteEvents;  /* events between the Russian roulettes of long-lived photons, 0 for none */
+    bool stratifiedGeometry;  /* spread per-sample geometry (the ABM-U mesophyll split) evenly over the photons */
+    bool antitheticGeometry;  /* pair photons up with complementary per-sample geometry */
+    bool controlVariate; /* correct R and T by the photons' first-surface reflections; no cache */
+    int qmcScrambles;    /* split each point's samples between this many Sobol scrambles, 0 for
+                            pseudo-random sampling; targetStderr and the cache don't apply */
+
+    SpectrumSettings() :
+        wavelengthStart(400),
+        wavelengthEnd(2500),
+        step(5),
+        numSamples(100000),
+        chunkSize(0),
+        targetStderr(0),
+        seed(0),
+        azimuthalAngle(0.0),
+        polarAngle(8.0 * M_PI / 180),
+        disableSieve(false),
+        tracer(TRACER_SCALAR),
+        solver(SOLVER_MONTE_CARLO),
+        solverBins(32),
+        jacobian(false),
+        verbose(true),
+        reportSchedule(false),
+        commonRandomNumbers(false),
+        rouletteEvents(DEFAULT_ROULETTE_EVENTS),
+        stratifiedGeometry(false),
+        antitheticGeometry(false),
+        controlVariate(false),
+        qmcScrambles(0)
+    {
+    }
+
+    /* Random stream of a wavelength's photons; photon i is substream i of it */
+    uint64_t randomStream(int wavelength) const {
+        return commonRandomNumbers ? 0 : wavelength;
+    }
+};
+
+struct SpectrumPoint {
+    int wavelength;
+    ReflectTally tally;  /* photons traced, when solved by Monte Carlo */
+    std::vector<ReflectTally> scrambles; /* the photons of each Sobol scramble, under quasi-Monte Carlo */
+    bool solved;         /* reflectance is in solution rather than counted in tally */
+    ReflectPair solution;
+    ReflectPair solutionDerivative;
+    bool controlVariate; /* tallies are read through their first-surface control variate */
+
+    SpectrumPoint() : wavelength(0), solved(false), solution(0, 0), solutionDerivative(0, 0), controlVariate(false) {
+    }
+
+    ReflectPair reflectance() const {
+        if(solved) {
+            return solution;
+        }
+        return controlVariate ? tally.controlledPair() : tally.pair();
+    }
+    /* dR/da and dT/da for the mesophyll absorption coefficient a */
+    ReflectPair absorptionDerivative() const {
+        return solved ? solutionDerivative : tally.absorptionDerivative();
+    }
+    /* Standard errors of reflectance(); under quasi-Monte Carlo, from the spread between scrambles */
+    ReflectPair standardError() const;
+    /* How many times fewer photons the control variate needs for the same R and T errors */
+    ReflectPair controlGain() const {
+        if(solved || !controlVariate) {
+            return ReflectPair(1, 1);
+        }
+        return ReflectPair(tally.reflectanceVariance() / tally.controlledReflectanceVariance(),
+                tally.transmittanceVariance() / tally.controlledTransmittanceVariance());
+    }
+};
+
+bool parseSolverType(const char *name, SolverType &solver);
+
+/* Simulates every wavelength of settings on the executor's workers, in wavelength order; a cache, if
+   given, supplies the photons already traced and receives the new ones */
+std::vector<SpectrumPoint> runSpectrum(Executor &executor, ABMInterfaceListBuilder &builder,
+        const Sample &sample, const SpectrumSettings &settings, ResultCache *cache = NULL);
+
+/* Receives the spectra of a batch as the samples finish */
+class SpectrumSink {
+    public:
+        virtual ~SpectrumSink() {
+        }
+        /* Called from a worker thread once every wavelength of the sample is final; calls never overlap */
+        virtual void sampleFinished(size_t sampleIndex, const std::vector<SpectrumPoint> &spectrum) = 0;
+};
+
+/* Simulates every sample at every wavelength of settings, with all of their tasks sharing the executor */
+void runSpectra(Executor &executor, ABMInterfaceListBuilder &builder, const std::vector<Sample> &samples,
+        const SpectrumSettings &settings, SpectrumSink &sink, ResultCache *cache = NULL);
+
+#endif
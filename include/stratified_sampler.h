@@ -0,0 +1,33 @@
+#ifndef __STRATIFIED_SAMPLER_H
+#define __STRATIFIED_SAMPLER_H
+
+#include <stdint.h>
+
+#include "abm_interfaces.h"
+#include "sobol.h"
+
+/*
+ * Per-sample geometry parameters spread over the photons of one (seed,
+ * stream). Stratified, photon i takes point i of a scrambled Sobol sequence,
+ * so the first 2^k photons of a wavelength hold one parameter value from each
+ * of 2^k equal strata (for ABM-U, of the mesophyll split), however the
+ * photons are divided into tasks or rounds. Antithetic, photons pair up: the
+ * second of each pair takes 1 - u for the first's u, and with stratification
+ * the pairs rather than the photons are stratified. Every parameter is still
+ * uniform for any one photon, so estimates stay unbiased; their binomial
+ * standard errors overstate the actual error.
+ */
+class StratifiedSampler : public SampleParameterSampler {
+    public:
+        StratifiedSampler(uint64_t seed, uint64_t stream, bool stratify, bool antithetic);
+        virtual void draw(RandomStream &rng, int numParameters, double *u) const;
+
+    private:
+        uint64_t seed;
+        uint64_t stream;
+        bool stratify;
+        bool antithetic;
+        SobolSequence sequence;
+};
+
+#endif
@@ -1,19 +1,25 @@
+#include <cmath>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <cstdlib>
 #include <iostream>
 #include <stdexcept>
+#include <sys/stat.h>
 
 #include "abm_interfaces.h"
+#include "content_hash.h"
+#include "random_stream.h"
 #include "sample.h"
+#include "scattering_table.h"
+#include "spectral_library.h"
 
-DataList::DataList() : begin(0), step(0) {
+DataList::DataList() : begin(0), step(0), mapped(NULL), count(0) {
 
 }
 
 DataList::DataList(std::ifstream &input,
-        unsigned int begin, unsigned int step) : begin(begin), step(step) {
+        unsigned int begin, unsigned int step) : begin(begin), step(step), mapped(NULL), count(0) {
     std::string tmp;
     while(std::getline(input, tmp)) {
         if(tmp != "") {
@@ -23,12 +29,30 @@ DataList::DataList(std::ifstream &input,
     }
 }
 
+DataList::DataList(const double *values, size_t count, unsigned int begin, unsigned int step) :
+    begin(begin), step(step), mapped(values), count(count) {
+
+}
+
 void DataList::adjustData(double multiplicationFactor) {
+    if(mapped != NULL) {
+        data.assign(mapped, mapped + count);
+        mapped = NULL;
+    }
     for(std::vector<double>::iterator it = data.begin(); it != data.end(); it++) {
         *it *= multiplicationFactor;
     }
 }
 
+void DataList::addToHash(ContentHash &hash) const {
+    hash.add((uint64_t)begin);
+    hash.add((uint64_t)step);
+    hash.add((uint64_t)size());
+    if(size() > 0) {
+        hash.add(values(), size() * sizeof(double));
+    }
+}
+
 DataList::~DataList() {
 
 }
@@ -38,11 +62,11 @@ double DataList::lookup(int wavelength) const {
     if(ind < 0) {
         std::cerr << "Warning, wavelength " << wavelength << " is below data point, clamping" << std::endl;
         ind = 0;
-    } else if( ind >= data.size()) {
+    } else if( ind >= size()) {
         std::cerr << "Warning, wavelength " << wavelength << " is above data point, clamping" << std::endl;
-        ind = data.size() - 1;
+        ind = size() - 1;
     }
-    return data[ind];
+    return values()[ind];
 }
 
 std::ostream& operator<<(std::ostream& os, const ABMInterface& x)
@@ -64,36 +88,189 @@ std::ostream& operator<<(std::ostream& os, const ABMInterface& x)
     return os;
 }
 
+void InterfaceList::buildSides() {
+    sides.resize(2 * interfaces.size());
+    for(size_t i = 0; i < interfaces.size(); i++) {
+        const ABMInterface &interface = interfaces[i];
+
+        InterfaceSide &down = sides[2*i + DIRECTION_DOWN];
+        down.n1 = interface.nAbove;
+        down.n2 = interface.nBelow;
+        down.perturbanceReflect = interface.perturbanceDownAbove;
+        down.perturbanceRefract = interface.perturbanceDownBelow;
+        down.thickness  = interface.thicknessAbove;
+        down.absorption = interface.absorptionAbove;
+        down.reflectState = i - 1;
+        down.refractState = i + 1;
+
+        InterfaceSide &up = sides[2*i + DIRECTION_UP];
+        up.n1 = interface.nBelow;
+        up.n2 = interface.nAbove;
+        up.perturbanceReflect = interface.perturbanceUpBelow;
+        up.perturbanceRefract = interface.perturbanceUpAbove;
+        up.thickness  = interface.thicknessBelow;
+        up.absorption = interface.absorptionBelow;
+        up.reflectState = i + 1;
+        up.refractState = i - 1;
+    }
+}
+
+void InterfaceList::prepareForSample(RandomStream &rng) {
+    const int numParameters = numSampleParameters();
+    if(numParameters == 0) {
+        return;
+    }
+    double u[MAX_SAMPLE_PARAMETERS];
+    if(parameterSampler != NULL) {
+        parameterSampler->draw(rng, numParameters, u);
+    } else {
+        for(int k = 0; k < numParameters; k++) {
+            u[k] = rng.sample(k);
+        }
+    }
+    setSampleParameters(u);
+}
+
+void InterfaceList::useScatteringTables(ScatteringTableSet &tables) {
+    // A refilled list usually keeps its perturbances, and with them its tables; the set takes a lock
+    bool complete = true;
+    for(size_t i = 0; i < sides.size() && complete; i++) {
+        const double perturbances[2] = { sides[i].perturbanceReflect, sides[i].perturbanceRefract };
+        for(int j = 0; j < 2; j++) {
+            complete = complete && (perturbances[j] == INFINITY || scatteringTable(perturbances[j]) != NULL);
+        }
+    }
+    if(complete) {
+        return;
+    }
+    scatteringTables.clear();
+    for(size_t i = 0; i < sides.size(); i++) {
+        const double perturbances[2] = { sides[i].perturbanceReflect, sides[i].perturbanceRefract };
+        for(int j = 0; j < 2; j++) {
+            if(perturbances[j] != INFINITY && scatteringTable(perturbances[j]) == NULL) {
+                scatteringTables.push_back(std::make_pair(perturbances[j], tables.get(perturbances[j])));
+            }
+        }
+    }
+}
+
 ABMInterfaceListBuilder::ABMInterfaceListBuilder(const std::string &dataDirectory)  :
-    dataDirectory(dataDirectory)
+    dataDirectory(dataDirectory),
+    scatteringTables(NULL)
 {
     readAllData(dataDirectory);
 }
 
+/* Every spectrum a builder reads, in spectrumList order, with the scale from its text file to the units kept */
+struct SpectrumFile {
+    const char *name;       /* in a SpectralLibrary */
+    const char *filename;
+    double scale;
+    const char *units;
+};
+
+#define NUM_SPECTRA 8
+
+static const SpectrumFile spectrumFiles[NUM_SPECTRA] = {
+    {"carotenoid",   "caro-PAS-400-2500.txt",   1.0 / 10.0, "m^2/kg"},
+    {"cellulose",    "cellulose400-2500.txt",   1.0 / 10.0, "m^2/kg"},
+    {"chlorophyll",  "chloAB-DFA-400-2500.txt", 1.0 / 10.0, "m^2/kg"},
+    {"protein",      "protein400-2500.txt",     1.0 / 10.0, "m^2/kg"},
+    {"water",        "sacwH400-2500.txt",       100,        "1/m"},
+    {"mesophyllRI",  "rmH400-2500.txt",         1,          ""},
+    {"cuticleRI",    "rcH400-2500.txt",         1,          ""},
+    {"antidermalRI", "raH400-2500.txt",         1,          ""},
+};
+
+DataList *ABMInterfaceListBuilder::spectrumList(int index) {
+    DataList *lists[NUM_SPECTRA] = {
+        &carotenoidAbsorption, &celluloseAbsorption, &chlorophyllAbsorption, &proteinAbsorption,
+        &waterAbsorption, &mesophyllRefractiveIndex, &cuticleRefractiveIndex, &antidermalRefractiveIndex
+    };
+    return lists[index];
+}
+
 void ABMInterfaceListBuilder::readAllData(const std::string &dataDirectory) {
-    const std::string carotenoidAbsorptionFilename("caro-PAS-400-2500.txt");
-    const std::string celluloseAbsorptionFilename("cellulose400-2500.txt");
-    const std::string chlorophyllAbsorptionFilename("chloAB-DFA-400-2500.txt");
-    const std::string proteinAbsorptionFilename("protein400-2500.txt");
-    const std::string waterAbsorptionFilename("sacwH400-2500.txt");
-    const std::string mesophyllRefractiveIndexFilename("rmH400-2500.txt");
-    const std::string cuticleRefractiveIndexFilename("rcH400-2500.txt"); 
-    const std::string antidermalRefractiveIndexFilename("raH400-2500.txt"); 
-
-    readData(dataDirectory + "/" + carotenoidAbsorptionFilename, carotenoidAbsorption);
-    readData(dataDirectory + "/" + celluloseAbsorptionFilename, celluloseAbsorption);
-    readData(dataDirectory + "/" + chlorophyllAbsorptionFilename, chlorophyllAbsorption);
-    readData(dataDirectory + "/" + proteinAbsorptionFilename, proteinAbsorption);
-    readData(dataDirectory + "/" + waterAbsorptionFilename, waterAbsorption);
-    readData(dataDirectory + "/" + mesophyllRefractiveIndexFilename, mesophyllRefractiveIndex);
-    readData(dataDirectory + "/" + cuticleRefractiveIndexFilename, cuticleRefractiveIndex);
-    readData(dataDirectory + "/" + antidermalRefractiveIndexFilename, antidermalRefractiveIndex);
-
-    carotenoidAbsorption.adjustData(1.0 / 10.0);
-    celluloseAbsorption.adjustData(1.0 / 10.0);
-    chlorophyllAbsorption.adjustData(1.0 / 10.0);
-    proteinAbsorption.adjustData(1.0 / 10.0);
-    waterAbsorption.adjustData(100);
+    if(readLibrary(dataDirectory)) {
+        return;
+    }
+    for(int i = 0; i < NUM_SPECTRA; i++) {
+        readData(dataDirectory + "/" + spectrumFiles[i].filename, *spectrumList(i));
+    }
+    for(int i = 0; i < NUM_SPECTRA; i++) {
+        if(spectrumFiles[i].scale != 1) {
+            spectrumList(i)->adjustData(spectrumFiles[i].scale);
+        }
+    }
+}
+
+bool ABMInterfaceListBuilder::readLibrary(const std::string &dataDirectory) {
+    const std::string filename = dataDirectory + "/" + SPECTRAL_LIBRARY_FILENAME;
+    struct stat library;
+    if(stat(filename.c_str(), &library) != 0) {
+        return false;
+    }
+    // A text file edited since the library was built wins
+    for(int i = 0; i < NUM_SPECTRA; i++) {
+        const std::string textFilename = dataDirectory + "/" + spectrumFiles[i].filename;
+        struct stat text;
+        if(stat(textFilename.c_str(), &text) == 0 && text.st_mtime > library.st_mtime) {
+            std::cerr << "Warning, " << filename << " is older than " << textFilename << ", reading the text files" << std::endl;
+            return false;
+        }
+    }
+
+    SpectralLibrary spectra;
+    if(!spectra.open(filename)) {
+        return false;
+    }
+    const double *values[NUM_SPECTRA];
+    for(int i = 0; i < NUM_SPECTRA; i++) {
+        values[i] = spectra.find(spectrumFiles[i].name);
+        if(values[i] == NULL) {
+            std::cerr << "Warning, " << filename << " has no " << spectrumFiles[i].name << " series, reading the text files" << std::endl;
+            return false;
+        }
+    }
+    std::cerr << "Reading in " << filename << std::endl;
+    for(int i = 0; i < NUM_SPECTRA; i++) {
+        *spectrumList(i) = DataList(values[i], spectra.count(), spectra.start(), spectra.step());
+    }
+    return true;
+}
+
+bool ABMInterfaceListBuilder::writeLibrary(const std::string &filename) const {
+    const DataList &first = *spectrumList(0);
+    std::vector<SpectralSeries> series(NUM_SPECTRA);
+    for(int i = 0; i < NUM_SPECTRA; i++) {
+        const DataList &list = *spectrumList(i);
+        if(list.start() != first.start() || list.spacing() != first.spacing() || list.size() != first.size()) {
+            std::cerr << "Spectra " << spectrumFiles[0].filename << " and " << spectrumFiles[i].filename
+                << " don't share one wavelength grid" << std::endl;
+            return false;
+        }
+        series[i].name = spectrumFiles[i].name;
+        series[i].units = spectrumFiles[i].units;
+        series[i].values = list.values();
+    }
+    return writeSpectralLibrary(filename, series, first.size(), first.start(), first.spacing());
+}
+
+uint64_t ABMInterfaceListBuilder::dataChecksum() const {
+    ContentHash hash;
+    carotenoidAbsorption.addToHash(hash);
+    celluloseAbsorption.addToHash(hash);
+    chlorophyllAbsorption.addToHash(hash);
+    proteinAbsorption.addToHash(hash);
+    waterAbsorption.addToHash(hash);
+    mesophyllRefractiveIndex.addToHash(hash);
+    cuticleRefractiveIndex.addToHash(hash);
+    antidermalRefractiveIndex.addToHash(hash);
+    return hash.get();
+}
+
+int ABMInterfaceListBuilder::scatteringLevels() const {
+    return scatteringTables != NULL ? scatteringTables->getLevels() : 0;
 }
 
 void ABMInterfaceListBuilder::readData(std::string filename, DataList &dlist) {
@@ -111,6 +288,10 @@ void ABMInterfaceListBuilder::readData(std::string filename, DataList &dlist) {
 }
 
 InterfaceList* ABMInterfaceListBuilder::buildInterfaces(const Sample &sample, int wavelength) {
+   return buildInterfaces(sample, wavelength, mesophyllAbsorption(sample, wavelength));
+}
+
+double ABMInterfaceListBuilder::mesophyllAbsorption(const Sample &sample, int wavelength) const {
    const double cmg_to_mkg = 1000; //g/cm^3 to kg/m^3 
    double proteinAbsorptionCoefficient     = sample.proteinConcentration * cmg_to_mkg * proteinAbsorption.lookup(wavelength);
    double chlorophyllAbsorptionCoefficient = (sample.chlorophyllAConcentration + sample.chlorophyllBConcentration)  
@@ -119,18 +300,113 @@ InterfaceList* ABMInterfaceListBuilder::buildInterfaces(const Sample &sample, in
    double celluloseAbsorptionCoefficient = sample.celluloseConcentration * cmg_to_mkg * celluloseAbsorption.lookup(wavelength);
    double linginAbsorptionCoefficient = sample.linginConcentration * cmg_to_mkg * celluloseAbsorption.lookup(wavelength); //Use cellulose for lingin due to lack of data
    double waterAbsorptionCoefficient = waterAbsorption.lookup(wavelength);
-   double mesophyllAbsorption = proteinAbsorptionCoefficient + chlorophyllAbsorptionCoefficient + 
+   return proteinAbsorptionCoefficient + chlorophyllAbsorptionCoefficient + 
        carotenoidAbsorptionCoefficient + celluloseAbsorptionCoefficient + linginAbsorptionCoefficient +
        waterAbsorptionCoefficient;
+}
+
+const char *absorberNames[NUM_ABSORBERS] = {
+    "chlorophyllA", "chlorophyllB", "carotenoid", "protein", "cellulose", "lignin", "water"
+};
+
+void ABMInterfaceListBuilder::mesophyllAbsorptionGradient(int wavelength, double gradient[NUM_ABSORBERS]) const {
+   const double cmg_to_mkg = 1000; //g/cm^3 to kg/m^3 
+   gradient[ABSORBER_CHLOROPHYLL_A] = cmg_to_mkg * chlorophyllAbsorption.lookup(wavelength);
+   gradient[ABSORBER_CHLOROPHYLL_B] = cmg_to_mkg * chlorophyllAbsorption.lookup(wavelength);
+   gradient[ABSORBER_CAROTENOID] = cmg_to_mkg * carotenoidAbsorption.lookup(wavelength);
+   gradient[ABSORBER_PROTEIN] = cmg_to_mkg * proteinAbsorption.lookup(wavelength);
+   gradient[ABSORBER_CELLULOSE] = cmg_to_mkg * celluloseAbsorption.lookup(wavelength);
+   gradient[ABSORBER_LIGNIN] = cmg_to_mkg * celluloseAbsorption.lookup(wavelength);
+   gradient[ABSORBER_WATER] = waterAbsorption.lookup(wavelength);
+}
+
+InterfaceList* ABMInterfaceListBuilder::buildInterfaces(const Sample &sample, int wavelength, double mesophyllAbsorption) {
+   return assembleInterfaces(NULL, sample, cuticleRefractiveIndex.lookup(wavelength), mesophyllRefractiveIndex.lookup(wavelength),
+           antidermalRefractiveIndex.lookup(wavelength), mesophyllAbsorption);
+}
+
+InterfaceList *ABMInterfaceListBuilder::buildInterfaces(const Sample &sample, const SpectralCoefficients &table,
+        size_t index) {
+   return buildInterfaces(sample, table, index, table.mesophyllAbsorption[index]);
+}
+
+InterfaceList *ABMInterfaceListBuilder::buildInterfaces(const Sample &sample, const SpectralCoefficients &table,
+        size_t index, double mesophyllAbsorption) {
+   return assembleInterfaces(NULL, sample, table.cuticleRI[index], table.mesophyllRI[index], table.antidermalRI[index],
+           mesophyllAbsorption);
+}
+
+void ABMInterfaceListBuilder::rebuildInterfaces(InterfaceList *&list, const Sample &sample,
+        const SpectralCoefficients &table, size_t index) {
+   rebuildInterfaces(list, sample, table, index, table.mesophyllAbsorption[index]);
+}
 
-   double cuticleRI = cuticleRefractiveIndex.lookup(wavelength);
-   double mesophyllRI = mesophyllRefractiveIndex.lookup(wavelength);
-   double antidermalRI = antidermalRefractiveIndex.lookup(wavelength);
+void ABMInterfaceListBuilder::rebuildInterfaces(InterfaceList *&list, const Sample &sample,
+        const SpectralCoefficients &table, size_t index, double mesophyllAbsorption) {
+   list = assembleInterfaces(list, sample, table.cuticleRI[index], table.mesophyllRI[index], table.antidermalRI[index],
+           mesophyllAbsorption);
+}
+
+void ABMInterfaceListBuilder::tabulate(const Sample &sample, const std::vector<int> &wavelengths,
+        SpectralCoefficients &table) const {
+   const size_t n = wavelengths.size();
+   table.wavelengths = wavelengths;
+   table.mesophyllAbsorption.resize(n);
+   table.cuticleRI.resize(n);
+   table.mesophyllRI.resize(n);
+   table.antidermalRI.resize(n);
+   AlignedArray protein, chlorophyll, carotenoid, cellulose;
+   protein.resize(n);
+   chlorophyll.resize(n);
+   carotenoid.resize(n);
+   cellulose.resize(n);
+   for(size_t k = 0; k < n; k++) {
+       protein[k] = proteinAbsorption.lookup(wavelengths[k]);
+       chlorophyll[k] = chlorophyllAbsorption.lookup(wavelengths[k]);
+       carotenoid[k] = carotenoidAbsorption.lookup(wavelengths[k]);
+       cellulose[k] = celluloseAbsorption.lookup(wavelengths[k]);
+       table.mesophyllAbsorption[k] = waterAbsorption.lookup(wavelengths[k]);
+       table.cuticleRI[k] = cuticleRefractiveIndex.lookup(wavelengths[k]);
+       table.mesophyllRI[k] = mesophyllRefractiveIndex.lookup(wavelengths[k]);
+       table.antidermalRI[k] = antidermalRefractiveIndex.lookup(wavelengths[k]);
+   }
+   if(n == 0) {
+       return;
+   }
+
+   // Summed in mesophyllAbsorption's order, so the two agree to the last bit
+   const double cmg_to_mkg = 1000; //g/cm^3 to kg/m^3
+   const double proteinScale = sample.proteinConcentration * cmg_to_mkg;
+   const double chlorophyllScale = (sample.chlorophyllAConcentration + sample.chlorophyllBConcentration) * cmg_to_mkg;
+   const double carotenoidScale = sample.carotenoidConcentration * cmg_to_mkg;
+   const double celluloseScale = sample.celluloseConcentration * cmg_to_mkg;
+   const double linginScale = sample.linginConcentration * cmg_to_mkg; //Use cellulose for lingin due to lack of data
+   double *absorption = table.mesophyllAbsorption.values();
+   for(size_t k = 0; k < n; k++) {
+       absorption[k] = proteinScale * protein[k] + chlorophyllScale * chlorophyll[k] +
+           carotenoidScale * carotenoid[k] + celluloseScale * cellulose[k] + linginScale * cellulose[k] +
+           absorption[k];
+   }
+}
+
+InterfaceList *ABMInterfaceListBuilder::assembleInterfaces(InterfaceList *list, const Sample &sample, double cuticleRI,
+        double mesophyllRI, double antidermalRI, double mesophyllAbsorption) {
    double airRI = 1.0;
 
    double mesophyllThickness = sample.mesophyllFraction * sample.wholeLeafThickness;
 
-   return createInterfaceList(sample, airRI, cuticleRI, mesophyllRI, antidermalRI, mesophyllAbsorption, mesophyllThickness);
+   InterfaceList *interfaces = list;
+   if(interfaces == NULL) {
+       interfaces = createInterfaceList(sample, airRI, cuticleRI, mesophyllRI, antidermalRI,
+               mesophyllAbsorption, mesophyllThickness);
+   } else {
+       refillInterfaceList(*interfaces, sample, airRI, cuticleRI, mesophyllRI, antidermalRI,
+               mesophyllAbsorption, mesophyllThickness);
+   }
+   if(interfaces != NULL && scatteringTables != NULL) {
+       interfaces->useScatteringTables(*scatteringTables);
+   }
+   return interfaces;
 }
 
 InterfaceList *ABMInterfaceListBuilder::createInterfaceList(const Sample &sample, double airRI,
@@ -138,3 +414,8 @@ InterfaceList *ABMInterfaceListBuilder::createInterfaceList(const Sample &sample
                         double mesophyllAbsorption, double mesophyllThickness) {
     return NULL;
 }
+
+void ABMInterfaceListBuilder::refillInterfaceList(InterfaceList &list, const Sample &sample, double airRI,
+                        double cuticleRI, double mesophyllRI, double antidermalRI,
+                        double mesophyllAbsorption, double mesophyllThickness) {
+}
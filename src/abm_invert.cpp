@@ -0,0 +1,221 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <getopt.h>
+
+#include "inversion.h"
+#include "sample_parser.h"
+#include "sample.h"
+#include "simulator.h"
+#include "stdlib.h"
+
+static void usage(const char *programName) {
+    fprintf(stderr, "Usage: ./%s [options] <initial_sample.json> <measured.csv> <fitted_sample.json>\n", programName);
+    fprintf(stderr, "\t-f <key>:<lower>:<upper>\tFit this sample field within these bounds (repeat for each)\n");
+    fprintf(stderr, "\t-n <int>\tMost samples per wavelength to refine the fit with\n");
+    fprintf(stderr, "\t-i <int>\tSamples per wavelength to start the fit with\n");
+    fprintf(stderr, "\t-a <float>\tAzimuthal angle\n");
+    fprintf(stderr, "\t-p <float>\tPolar angle\n");
+    fprintf(stderr, "\t-d <path>\tData directory\n");
+    fprintf(stderr, "\t-t <int>\tNumber of threads (0 for one per processor)\n");
+    fprintf(stderr, "\t-r <int>\tRandom seed, shared by every evaluation\n");
+    fprintf(stderr, "\t-m <name>\tTracer: scalar (default), packet, reduced or implicit\n");
+    fprintf(stderr, "\t-k <int>\tSample scattering from tables with this many levels (0 samples exactly)\n");
+    fprintf(stderr, "\t-q\tDisable sieve and detour effects\n");
+    fprintf(stderr, "\t--model <name>\tabmu or abmb (default: abmb for bifacial samples, abmu otherwise)\n");
+    fprintf(stderr, "\t--iterations <int>\tMost Levenberg-Marquardt iterations (default 100)\n");
+    fprintf(stderr, "\t--tolerance <float>\tRelative misfit decrease that counts as progress (default 1e-3)\n");
+    fprintf(stderr, "\t--solver <name>\tmonte-carlo (default) or deterministic\n");
+    fprintf(stderr, "\t--bins <int>\tcos(theta) bins of the deterministic solver (default 32)\n");
+    fprintf(stderr, "\t--crn\tDraw the same random numbers for photon i at every wavelength\n");
+    fprintf(stderr, "\t--path-lengths\tEvaluate candidates from paths traced once per sample count (concentrations only)\n");
+    fprintf(stderr, "\n");
+}
+
+static struct option longOptions[] = {
+    {"model", required_argument, NULL, 'O'},
+    {"iterations", required_argument, NULL, 'I'},
+    {"tolerance", required_argument, NULL, 'T'},
+    {"solver", required_argument, NULL, 'S'},
+    {"bins", required_argument, NULL, 'M'},
+    {"path-lengths", no_argument, NULL, 'L'},
+    {"crn", no_argument, NULL, 'R'},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char *argv[]) {
+    const char *programName = "abm-invert";
+    const char *datadir = "data";
+    int numThreads = 4;
+    int scatteringLevels = 0;
+    const char *modelName = NULL;
+    std::vector<FreeParameter> parameters;
+    SpectrumSettings settings;
+    InversionSettings inversion;
+    settings.seed = time(NULL);
+
+    int c;
+    while((c = getopt_long(argc, argv, "f:n:i:a:p:d:t:r:m:k:q", longOptions, NULL)) != -1) {
+        switch(c) {
+            case 'f': {
+                FreeParameter parameter;
+                if(!parseFreeParameter(optarg, parameter)) {
+                    fprintf(stderr, "Bad free parameter '%s'\n", optarg);
+                    usage(programName);
+                    return 2;
+                }
+                parameters.push_back(parameter);
+                break;
+            }
+            case 'n':
+                settings.numSamples = atoi(optarg);
+                break;
+            case 'i':
+                inversion.initialSamples = atoi(optarg);
+                break;
+            case 'a':
+                settings.azimuthalAngle = atof(optarg) * M_PI / 180;
+                break;
+            case 'p':
+                settings.polarAngle = atof(optarg) * M_PI / 180;
+                break;
+            case 'd':
+                datadir = optarg;
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'r':
+                settings.seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                if(!parseTracerMode(optarg, settings.tracer)) {
+                    fprintf(stderr, "Unknown tracer '%s'\n", optarg);
+                    usage(programName);
+                    return 2;
+                }
+                break;
+            case 'k':
+                scatteringLevels = atoi(optarg);
+                break;
+            case 'q':
+                settings.disableSieve = true;
+                break;
+            case 'O':
+                modelName = optarg;
+                break;
+            case 'I':
+                inversion.maxIterations = atoi(optarg);
+                break;
+            case 'T':
+                inversion.tolerance = atof(optarg);
+                break;
+            case 'S':
+                if(!parseSolverType(optarg, settings.solver)) {
+                    fprintf(stderr, "Unknown solver '%s'\n", optarg);
+                    usage(programName);
+                    return 2;
+                }
+                break;
+            case 'M':
+                settings.solverBins = atoi(optarg);
+                break;
+            case 'L':
+                inversion.pathLengths = true;
+                break;
+            case 'R':
+                settings.commonRandomNumbers = true;
+                break;
+            case '?':
+                break;
+            default:
+                fprintf(stderr, "Getopt returned error\n");
+                return 2;
+        }
+    }
+
+    if(argc - optind != 3) {
+        fprintf(stderr, "Initial sample, measurements and output file are required\n");
+        usage(programName);
+        return 2;
+    }
+    if(parameters.empty()) {
+        fprintf(stderr, "Nothing to fit; give at least one -f\n");
+        usage(programName);
+        return 2;
+    }
+
+    Sample sample = Sample();
+    FILE *sampleFile = fopen(argv[optind], "r");
+    if(sampleFile == NULL) {
+        fprintf(stderr, "Error while opening '%s'\n", argv[optind]);
+        return 1;
+    }
+    int parsed = parseSampleFromFile(&sample, sampleFile);
+    fclose(sampleFile);
+    if(!parsed) {
+        fprintf(stderr, "Error while parsing sample json\n");
+        return 1;
+    }
+
+    MeasuredSpectrum measured;
+    FILE *measuredFile = fopen(argv[optind+1], "r");
+    if(measuredFile == NULL) {
+        fprintf(stderr, "Error while opening '%s'\n", argv[optind+1]);
+        return 1;
+    }
+    parsed = readMeasuredSpectrum(measuredFile, measured);
+    fclose(measuredFile);
+    if(!parsed) {
+        return 1;
+    }
+
+    ModelType model = sample.bifacial ? MODEL_ABMB : MODEL_ABMU;
+    if(modelName != NULL && strcmp(modelName, "abmu") == 0) {
+        model = MODEL_ABMU;
+    } else if(modelName != NULL && strcmp(modelName, "abmb") == 0) {
+        model = MODEL_ABMB;
+    } else if(modelName != NULL) {
+        fprintf(stderr, "Unknown model '%s'\n", modelName);
+        usage(programName);
+        return 2;
+    }
+
+    if(inversion.pathLengths) {
+        // Paths are traced for one morphology, so only parameters that leave it alone may move
+        for(size_t j = 0; j < parameters.size(); j++) {
+            Sample moved = sample;
+            moved.*parameters[j].field = parameters[j].lower;
+            Sample other = sample;
+            other.*parameters[j].field = parameters[j].upper;
+            if(!sameMorphology(moved, other)) {
+                fprintf(stderr, "--path-lengths can't fit %s, which changes the leaf structure\n", parameters[j].name);
+                return 2;
+            }
+        }
+    }
+
+    FILE *outputFile = fopen(argv[optind+2], "w");
+    if(outputFile == NULL) {
+        fprintf(stderr, "Error while opening output '%s'\n", argv[optind+2]);
+        return 1;
+    }
+
+    fprintf(stderr, "Fitting %lu parameters to %lu wavelengths (%s, up to %d samples, seed %lu)...\n",
+            (unsigned long)parameters.size(), (unsigned long)measured.wavelengths.size(),
+            model == MODEL_ABMB ? "abmb" : "abmu", settings.numSamples, settings.seed);
+
+    Simulator simulator(datadir, numThreads, scatteringLevels);
+    InversionResult result = invertSpectrum(simulator, model, sample, parameters, measured, settings, inversion);
+
+    for(size_t j = 0; j < parameters.size(); j++) {
+        fprintf(stderr, "%s = %g\n", parameters[j].name, result.sample.*parameters[j].field);
+    }
+    fprintf(stderr, "Misfit %f after %d iterations (%d samples)\n", result.misfit, result.iterations,
+            result.numSamples);
+    writeSample(outputFile, result.sample);
+    fclose(outputFile);
+    return 0;
+}
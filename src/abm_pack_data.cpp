@@ -0,0 +1,46 @@
+#include <cstdio>
+#include <string>
+#include <getopt.h>
+
+#include "abm_interfaces.h"
+#include "spectral_library.h"
+
+static void usage(const char *programName) {
+    fprintf(stderr, "Usage: ./%s [options] [<library>]\n", programName);
+    fprintf(stderr, "\tWrites the spectral data as one binary library, by default %s in the data directory\n",
+            SPECTRAL_LIBRARY_FILENAME);
+    fprintf(stderr, "\t-d <path>\tData directory\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *programName = "abm-pack-data";
+    const char *datadir = "data";
+
+    int c;
+    while((c = getopt(argc, argv, "d:")) != -1) {
+        switch(c) {
+            case 'd':
+                datadir = optarg;
+                break;
+            case '?':
+                break;
+            default:
+                fprintf(stderr, "Getopt returned error\n");
+                return 2;
+        }
+    }
+    if(argc - optind > 1) {
+        usage(programName);
+        return 2;
+    }
+    const std::string library = argc - optind == 1 ? argv[optind] : std::string(datadir) + "/" + SPECTRAL_LIBRARY_FILENAME;
+
+    // A current library reads back as the same values, so packing again is harmless
+    ABMInterfaceListBuilder builder(datadir);
+    if(!builder.writeLibrary(library)) {
+        return 1;
+    }
+    fprintf(stderr, "Wrote %s (checksum %016llx)\n", library.c_str(), (unsigned long long)builder.dataChecksum());
+    return 0;
+}
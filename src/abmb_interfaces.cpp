@@ -10,14 +10,22 @@
 #include "sample.h"
 
 ABMBInterfaceList::ABMBInterfaceList(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI, 
-                   double antidermalRI, double mesophyllAbsorption, double mesophyllThickness) :
-    airRI(airRI),
-    cuticleRI(cuticleRI),
-    mesophyllRI(mesophyllRI),
-    antidermalRI(antidermalRI),
-    mesophyllAbsorption(mesophyllAbsorption),
-    mesophyllThickness(mesophyllThickness)
+                   double antidermalRI, double mesophyllAbsorption, double mesophyllThickness)
 {
+   interfaces.reserve(6);
+   assign(sample, airRI, cuticleRI, mesophyllRI, antidermalRI, mesophyllAbsorption, mesophyllThickness);
+}
+
+void ABMBInterfaceList::assign(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI,
+                   double antidermalRI, double mesophyllAbsorption, double mesophyllThickness) {
+   this->airRI = airRI;
+   this->cuticleRI = cuticleRI;
+   this->mesophyllRI = mesophyllRI;
+   this->antidermalRI = antidermalRI;
+   this->mesophyllAbsorption = mesophyllAbsorption;
+   this->mesophyllThickness = mesophyllThickness;
+   interfaces.clear();
+
    ABMInterface airCuticle;
    airCuticle.name   = "Air<->Adaxial Epidermis";
    airCuticle.nAbove = airRI;
@@ -79,9 +87,8 @@ ABMBInterfaceList::ABMBInterfaceList(const Sample &sample, double airRI, double
    cuticleAir.perturbanceUpBelow   = sample.cuticleUndulationsAspectRatio;
 
    interfaces.push_back(cuticleAir);
-}
 
-void ABMBInterfaceList::prepareForSample() {
+   buildSides();
 }
 
 ABMBInterfaceListBuilder::ABMBInterfaceListBuilder(const std::string &dataDirectory) :
@@ -89,6 +96,11 @@ ABMBInterfaceListBuilder::ABMBInterfaceListBuilder(const std::string &dataDirect
 {
 }
 
+ABMBInterfaceListBuilder::ABMBInterfaceListBuilder(const ABMInterfaceListBuilder &data) :
+    ABMInterfaceListBuilder(data)
+{
+}
+
 InterfaceList *ABMBInterfaceListBuilder::createInterfaceList(const Sample &sample, double airRI,
                         double cuticleRI, double mesophyllRI, double antidermalRI,
                         double mesophyllAbsorption, double mesophyllThickness) {
@@ -97,3 +109,10 @@ InterfaceList *ABMBInterfaceListBuilder::createInterfaceList(const Sample &sampl
             mesophyllAbsorption, mesophyllThickness);
 }
 
+void ABMBInterfaceListBuilder::refillInterfaceList(InterfaceList &list, const Sample &sample, double airRI,
+                        double cuticleRI, double mesophyllRI, double antidermalRI,
+                        double mesophyllAbsorption, double mesophyllThickness) {
+    static_cast<ABMBInterfaceList &>(list).assign(sample, airRI, cuticleRI, mesophyllRI, antidermalRI,
+            mesophyllAbsorption, mesophyllThickness);
+}
+
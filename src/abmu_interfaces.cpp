@@ -9,21 +9,24 @@
 #include "abmu_interfaces.h"
 #include "sample.h"
 
-extern "C" {
-    #include "mt19937ar.h"
+ABMUInterfaceList::ABMUInterfaceList(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI, 
+                   double antidermalRI, double mesophyllAbsorption, double mesophyllThickness)
+{
+   interfaces.reserve(6);
+   assign(sample, airRI, cuticleRI, mesophyllRI, antidermalRI, mesophyllAbsorption, mesophyllThickness);
 }
 
-#define RANDOM_FUNCTION genrand_real2
+void ABMUInterfaceList::assign(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI,
+                   double antidermalRI, double mesophyllAbsorption, double mesophyllThickness) {
+   this->airRI = airRI;
+   this->cuticleRI = cuticleRI;
+   this->mesophyllRI = mesophyllRI;
+   this->antidermalRI = antidermalRI;
+   this->mesophyllAbsorption = mesophyllAbsorption;
+   this->mesophyllThickness = mesophyllThickness;
+   // Clearing keeps the storage, so refilling allocates nothing
+   interfaces.clear();
 
-ABMUInterfaceList::ABMUInterfaceList(const Sample &sample, double airRI, double cuticleRI, double mesophyllRI, 
-                   double antidermalRI, double mesophyllAbsorption, double mesophyllThickness) :
-    airRI(airRI),
-    cuticleRI(cuticleRI),
-    mesophyllRI(mesophyllRI),
-    antidermalRI(antidermalRI),
-    mesophyllAbsorption(mesophyllAbsorption),
-    mesophyllThickness(mesophyllThickness)
-{
    ABMInterface airCuticle;
    airCuticle.name   = "Air<->Adaxial Epidermis";
    airCuticle.nAbove = airRI;
@@ -95,14 +98,16 @@ ABMUInterfaceList::ABMUInterfaceList(const Sample &sample, double airRI, double
    epidermisAir.perturbanceUpBelow   = sample.cuticleUndulationsAspectRatio;
 
    interfaces.push_back(epidermisAir);
+
+   buildSides();
 }
 
-void ABMUInterfaceList::prepareForSample() {
-    double p = RANDOM_FUNCTION();
-    interfaces[1].thicknessBelow =  p    * mesophyllThickness;
-    interfaces[2].thicknessAbove =  p    * mesophyllThickness;
-    interfaces[3].thicknessBelow = (1-p) * mesophyllThickness;
-    interfaces[4].thicknessAbove = (1-p) * mesophyllThickness;
+void ABMUInterfaceList::setSampleParameters(const double *u) {
+    double p = u[0];
+    setThicknessBelow(1,  p    * mesophyllThickness);
+    setThicknessAbove(2,  p    * mesophyllThickness);
+    setThicknessBelow(3, (1-p) * mesophyllThickness);
+    setThicknessAbove(4, (1-p) * mesophyllThickness);
 }
 
 ABMUInterfaceListBuilder::ABMUInterfaceListBuilder(const std::string &dataDirectory) :
@@ -110,6 +115,11 @@ ABMUInterfaceListBuilder::ABMUInterfaceListBuilder(const std::string &dataDirect
 {
 }
 
+ABMUInterfaceListBuilder::ABMUInterfaceListBuilder(const ABMInterfaceListBuilder &data) :
+    ABMInterfaceListBuilder(data)
+{
+}
+
 InterfaceList *ABMUInterfaceListBuilder::createInterfaceList(const Sample &sample, double airRI,
                         double cuticleRI, double mesophyllRI, double antidermalRI,
                         double mesophyllAbsorption, double mesophyllThickness) {
@@ -118,3 +128,10 @@ InterfaceList *ABMUInterfaceListBuilder::createInterfaceList(const Sample &sampl
             mesophyllAbsorption, mesophyllThickness);
 }
 
+void ABMUInterfaceListBuilder::refillInterfaceList(InterfaceList &list, const Sample &sample, double airRI,
+                        double cuticleRI, double mesophyllRI, double antidermalRI,
+                        double mesophyllAbsorption, double mesophyllThickness) {
+    static_cast<ABMUInterfaceList &>(list).assign(sample, airRI, cuticleRI, mesophyllRI, antidermalRI,
+            mesophyllAbsorption, mesophyllThickness);
+}
+
@@ -0,0 +1,483 @@
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cli.h"
+#include "run_abm.h"
+#include "sample_parser.h"
+#include "sample.h"
+#include "simulator.h"
+#include "stdlib.h"
+#include "unistd.h"
+
+
+static void usage(const char *programName) {
+    fprintf(stderr, "Usage: ./%s [options] <sample_file.json> <output_file.csv>\n", programName);
+    fprintf(stderr, "       ./%s [options] --batch <sample_directory|manifest.jsonl> <output_file.csv>\n", programName);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t-n <int>\tNumber of samples\n");
+    fprintf(stderr, "\t-a <float>\tAzimuthal angle (degrees)\n");
+    fprintf(stderr, "\t-p <float>\tPolar angle (degrees)\n");
+    fprintf(stderr, "\t-s <int>\tWavelength step (nanometers)\n");
+    fprintf(stderr, "\t-w <int>\tWavelength start (nanometers)\n");
+    fprintf(stderr, "\t-e <int>\tWavelength end (nanometers)\n");
+    fprintf(stderr, "\t-d <path>\tData directory\n");
+    fprintf(stderr, "\t-t <int>\tNumber of threads (0 for one per processor)\n");
+    fprintf(stderr, "\t-r <int>\tRandom seed (defaults to the current time)\n");
+    fprintf(stderr, "\t-c <int>\tSamples per task (defaults to enough tasks to keep every thread busy)\n");
+    fprintf(stderr, "\t-m <name>\tTracer: scalar (default), packet, reduced or implicit\n");
+    fprintf(stderr, "\t-k <int>\tSample scattering from tables with this many levels (0 samples exactly)\n");
+    fprintf(stderr, "\t-q\tDisable sieve and detour effects\n");
+    fprintf(stderr, "\t-v\tReport how well each round's predicted task costs matched\n");
+    fprintf(stderr, "\t--target-stderr <float>\tAdd samples until R and T reach this standard error (-n caps them)\n");
+    fprintf(stderr, "\t--solver <name>\tmonte-carlo (default) or deterministic\n");
+    fprintf(stderr, "\t--bins <int>\tcos(theta) bins of the deterministic solver (default 32)\n");
+    fprintf(stderr, "\t--path-lengths\tTrace absorption-free paths once per leaf structure and apply each sample's absorption to them\n");
+    fprintf(stderr, "\t--jacobian\tAppend dR/dC and dT/dC for each absorber's concentration\n");
+    fprintf(stderr, "\t--roulette-events <int>\tEvents after which photons play Russian roulette (default %d, 0 never)\n",
+            DEFAULT_ROULETTE_EVENTS);
+    fprintf(stderr, "\t--stratify\tSpread ABM-U's mesophyll split evenly over each wavelength's photons\n");
+    fprintf(stderr, "\t--antithetic\tPair photons up with complementary mesophyll splits\n");
+    fprintf(stderr, "\t--control-variate\tCorrect R and T by each photon's first-surface reflection and report the gain\n");
+    fprintf(stderr, "\t--qmc <int>\tSample with this many independent Sobol scrambles (at least 2), which give the standard errors\n");
+    fprintf(stderr, "\t--crn\tDraw the same random numbers for photon i at every wavelength (the seed defaults to 0)\n");
+    fprintf(stderr, "\t--cache <path>\tReuse and extend results stored in this directory (the seed defaults to 0)\n");
+    fprintf(stderr, "\t--batch\tSimulate every *.json file of a directory, or every line of a JSON-lines manifest\n");
+    fprintf(stderr, "\n");
+}
+
+static struct option longOptions[] = {
+    {"target-stderr", required_argument, NULL, 'E'},
+    {"batch", no_argument, NULL, 'B'},
+    {"cache", required_argument, NULL, 'C'},
+    {"solver", required_argument, NULL, 'S'},
+    {"bins", required_argument, NULL, 'M'},
+    {"path-lengths", no_argument, NULL, 'L'},
+    {"jacobian", no_argument, NULL, 'J'},
+    {"crn", no_argument, NULL, 'R'},
+    {"roulette-events", required_argument, NULL, 'V'},
+    {"qmc", required_argument, NULL, 'Q'},
+    {"stratify", no_argument, NULL, 'G'},
+    {"antithetic", no_argument, NULL, 'A'},
+    {"control-variate", no_argument, NULL, 'Z'},
+    {NULL, 0, NULL, 0}
+};
+
+/* Which columns the CSV has */
+struct OutputFormat {
+    bool batch;                 /* leading sample column */
+    bool standardErrors;        /* standard errors and sample counts */
+    bool controlGain;           /* variance reduction of the control variate */
+    const Simulator *jacobian;  /* derivative columns, chained through this simulator's absorption data; NULL for none */
+};
+
+static void writeHeader(FILE *outputFile, const OutputFormat &format) {
+    fprintf(outputFile, "%swavelength, reflectance, transmittance, absorptance%s", format.batch ? "sample, " : "",
+            format.standardErrors ? ", reflectance_stderr, transmittance_stderr, samples" : "");
+    if(format.controlGain) {
+        fprintf(outputFile, ", reflectance_cv_gain, transmittance_cv_gain");
+    }
+    if(format.jacobian != NULL) {
+        for(int k = 0; k < NUM_ABSORBERS; k++) {
+            fprintf(outputFile, ", dR_d%s, dT_d%s", absorberNames[k], absorberNames[k]);
+        }
+    }
+    fprintf(outputFile, "\n");
+}
+
+static void writeSpectrum(FILE *outputFile, const char *sampleName, const std::vector<SpectrumPoint> &spectrum,
+        const OutputFormat &format) {
+    for(std::vector<SpectrumPoint>::const_iterator result = spectrum.begin();
+            result != spectrum.end(); result++) {
+        int w = result->wavelength;
+        ReflectPair rt = result->reflectance();
+        if(sampleName != NULL) {
+            fprintf(outputFile, "%s,", sampleName);
+        }
+        fprintf(outputFile, "%d,%f,%f,%f", w, rt.first, rt.second, 1-(rt.first+rt.second));
+        if(format.standardErrors) {
+            const ReflectPair error = result->standardError();
+            fprintf(outputFile, ",%f,%f,%ld", error.first, error.second, result->tally.numSamples());
+        }
+        if(format.controlGain) {
+            const ReflectPair gain = result->controlGain();
+            fprintf(outputFile, ",%.3f,%.3f", gain.first, gain.second);
+        }
+        if(format.jacobian != NULL) {
+            // Chain dR/da through a's linear dependence on each concentration
+            double gradient[NUM_ABSORBERS];
+            format.jacobian->absorptionGradient(w, gradient);
+            const ReflectPair derivative = result->absorptionDerivative();
+            for(int k = 0; k < NUM_ABSORBERS; k++) {
+                // + 0.0 prints absorbers that don't absorb at this wavelength as 0 rather than -0
+                fprintf(outputFile, ",%g,%g", derivative.first * gradient[k] + 0.0,
+                        derivative.second * gradient[k] + 0.0);
+            }
+        }
+        fprintf(outputFile, "\n");
+    }
+    fflush(outputFile);
+}
+
+/* Writes each batch sample's rows as soon as it is done */
+class BatchWriter : public SpectrumSink {
+    public:
+        BatchWriter(FILE *outputFile, const std::vector<std::string> &names, const OutputFormat &format) :
+            outputFile(outputFile),
+            names(names),
+            format(format),
+            numFinished(0)
+        {
+        }
+
+        virtual void sampleFinished(size_t sampleIndex, const std::vector<SpectrumPoint> &spectrum) {
+            writeSpectrum(outputFile, names[sampleIndex].c_str(), spectrum, format);
+            numFinished++;
+            fprintf(stderr, "Sample %s done (%lu/%lu)\n", names[sampleIndex].c_str(),
+                    (unsigned long)numFinished, (unsigned long)names.size());
+        }
+
+    private:
+        FILE *outputFile;
+        const std::vector<std::string> &names;
+        OutputFormat format;
+        size_t numFinished;
+};
+
+/* Reads every *.json file of a directory, in name order */
+static bool readSampleDirectory(const char *path, std::vector<std::string> &names, std::vector<Sample> &samples) {
+    DIR *dir = opendir(path);
+    if(dir == NULL) {
+        fprintf(stderr, "Error while opening directory '%s'\n", path);
+        return false;
+    }
+    std::vector<std::string> files;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        std::string name(entry->d_name);
+        if(name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0) {
+            files.push_back(name);
+        }
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+
+    for(size_t i = 0; i < files.size(); i++) {
+        std::string filename = std::string(path) + "/" + files[i];
+        FILE *sampleFile = fopen(filename.c_str(), "r");
+        if(sampleFile == NULL) {
+            fprintf(stderr, "Error while opening '%s'\n", filename.c_str());
+            return false;
+        }
+        Sample sample = Sample();
+        int parsed = parseSampleFromFile(&sample, sampleFile);
+        fclose(sampleFile);
+        if(!parsed) {
+            fprintf(stderr, "Error while parsing sample json '%s'\n", filename.c_str());
+            return false;
+        }
+        names.push_back(files[i].substr(0, files[i].size() - 5));
+        samples.push_back(sample);
+    }
+    return true;
+}
+
+/* Reads one sample object per non-blank line; samples are named by line number */
+static bool readSampleManifest(const char *path, std::vector<std::string> &names, std::vector<Sample> &samples) {
+    std::ifstream manifest(path);
+    if(!manifest) {
+        fprintf(stderr, "Error while opening manifest '%s'\n", path);
+        return false;
+    }
+    std::string line;
+    for(int lineNumber = 1; std::getline(manifest, line); lineNumber++) {
+        if(line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        Sample sample = Sample();
+        if(!parseSampleFromString(&sample, line.data(), line.size())) {
+            fprintf(stderr, "Error while parsing sample json on line %d of '%s'\n", lineNumber, path);
+            return false;
+        }
+        char name[32];
+        sprintf(name, "%d", lineNumber);
+        names.push_back(name);
+        samples.push_back(sample);
+    }
+    return true;
+}
+
+/* Traces paths once for every run of samples sharing a morphology and evaluates each sample from them */
+static void simulateFromPaths(Simulator &simulator, const std::vector<Sample> &samples, ModelType model,
+        const SpectrumSettings &settings, SpectrumSink &sink) {
+    std::vector<bool> done(samples.size(), false);
+    for(size_t first = 0; first < samples.size(); first++) {
+        if(done[first]) {
+            continue;
+        }
+        std::vector<PathPoint> paths = simulator.tracePaths(samples[first], model, settings);
+        for(size_t i = first; i < samples.size(); i++) {
+            if(!done[i] && sameMorphology(samples[first], samples[i])) {
+                sink.sampleFinished(i, simulator.evaluatePaths(samples[i], model, paths));
+                done[i] = true;
+            }
+        }
+    }
+}
+
+static int runBatch(const char *inputPath, const char *outputFilename, ModelType model, const char *datadir,
+        int numThreads, int scatteringLevels, ResultCache *cache, bool pathLengths, const SpectrumSettings &settings) {
+    std::vector<std::string> names;
+    std::vector<Sample> samples;
+    struct stat info;
+    if(stat(inputPath, &info) != 0) {
+        fprintf(stderr, "Error while opening '%s'\n", inputPath);
+        return 1;
+    }
+    bool loaded = S_ISDIR(info.st_mode) ? readSampleDirectory(inputPath, names, samples) :
+        readSampleManifest(inputPath, names, samples);
+    if(!loaded) {
+        return 1;
+    }
+
+    FILE *outputFile = fopen(outputFilename, "w");
+    if(outputFile == NULL) {
+        fprintf(stderr, "Error while opening output '%s'", outputFilename);
+        return 1;
+    }
+
+    Simulator simulator(datadir, numThreads, scatteringLevels);
+    simulator.setCache(cache);
+
+    OutputFormat format;
+    format.batch = true;
+    format.standardErrors = settings.targetStderr > 0 || settings.qmcScrambles > 0 || settings.controlVariate;
+    format.controlGain = settings.controlVariate;
+    format.jacobian = settings.jacobian ? &simulator : NULL;
+    writeHeader(outputFile, format);
+    fprintf(stderr, "Running batch (%lu leaves, %d samples, wavelengths %dnm-%dnm, seed %lu)...\n",
+            (unsigned long)samples.size(), settings.numSamples, settings.wavelengthStart, settings.wavelengthEnd,
+            settings.seed);
+
+    BatchWriter writer(outputFile, names, format);
+    if(pathLengths) {
+        simulateFromPaths(simulator, samples, model, settings, writer);
+    } else {
+        simulator.simulateBatch(samples, model, settings, writer);
+    }
+
+    fclose(outputFile);
+    return 0;
+}
+
+int runCommandLine(int argc, char *argv[], ModelType model) {
+    const char *programName = model == MODEL_ABMB ? "abmb" : "abmu";
+    Sample sample;
+    FILE *sampleFile;
+    FILE *outputFile;
+    int retcode = 0;
+    SpectrumSettings settings;
+    settings.seed = time(NULL);
+    char *datadir = (char *)"data";
+    int c;
+    int numThreads = 4;
+    int scatteringLevels = 0;
+    bool batch = false;
+    bool seedGiven = false;
+    bool pathLengths = false;
+    char *cacheDirectory = NULL;
+
+    while((c = getopt_long(argc, argv, "n:a:p:w:s:e:d:t:r:c:m:k:qv", longOptions, NULL)) != -1) {
+        switch(c) {
+            case 'n':
+                settings.numSamples = atoi(optarg);
+                break;
+            case 'a':
+                settings.azimuthalAngle = atof(optarg) * M_PI / 180;
+                break;
+            case 'p':
+                settings.polarAngle = atof(optarg) * M_PI / 180;
+                break;
+            case 's':
+                settings.step = atoi(optarg);
+                break;
+            case 'w':
+                settings.wavelengthStart = atoi(optarg);
+                break;
+            case 'e':
+                settings.wavelengthEnd = atoi(optarg);
+                break;
+            case 'd':
+                datadir = optarg;
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'r':
+                settings.seed = strtoul(optarg, NULL, 10);
+                seedGiven = true;
+                break;
+            case 'c':
+                settings.chunkSize = atoi(optarg);
+                break;
+            case 'm':
+                if(!parseTracerMode(optarg, settings.tracer)) {
+                    fprintf(stderr, "Unknown tracer '%s'\n", optarg);
+                    usage(programName);
+                    return 2;
+                }
+                break;
+            case 'k':
+                scatteringLevels = atoi(optarg);
+                break;
+            case 'q':
+                settings.disableSieve = true;
+                break;
+            case 'v':
+                settings.reportSchedule = true;
+                break;
+            case 'E':
+                settings.targetStderr = atof(optarg);
+                break;
+            case 'B':
+                batch = true;
+                break;
+            case 'C':
+                cacheDirectory = optarg;
+                break;
+            case 'S':
+                if(!parseSolverType(optarg, settings.solver)) {
+                    fprintf(stderr, "Unknown solver '%s'\n", optarg);
+                    usage(programName);
+                    return 2;
+                }
+                break;
+            case 'M':
+                settings.solverBins = atoi(optarg);
+                break;
+            case 'L':
+                pathLengths = true;
+                break;
+            case 'J':
+                settings.jacobian = true;
+                break;
+            case 'R':
+                settings.commonRandomNumbers = true;
+                break;
+            case 'V':
+                settings.rouletteEvents = atoi(optarg);
+                break;
+            case 'Q':
+                settings.qmcScrambles = atoi(optarg);
+                break;
+            case 'G':
+                settings.stratifiedGeometry = true;
+                break;
+            case 'A':
+                settings.antitheticGeometry = true;
+                break;
+            case 'Z':
+                settings.controlVariate = true;
+                break;
+            case '?':
+                break;
+            default:
+                fprintf(stderr, "Getopt returned error\n");
+                return 2;
+        }
+    }
+
+    if(argc - optind != 2) {
+        fprintf(stderr, "Both sample file and output file are required\n");
+        usage(programName);
+        return 2;
+    }
+
+
+    if(settings.controlVariate && pathLengths) {
+        fprintf(stderr, "--control-variate can't be combined with --path-lengths\n");
+        usage(programName);
+        return 2;
+    }
+    if(settings.qmcScrambles != 0 && (settings.qmcScrambles < 2 || settings.targetStderr > 0 || pathLengths)) {
+        fprintf(stderr, "--qmc needs at least 2 scrambles and can't be combined with --target-stderr or --path-lengths\n");
+        usage(programName);
+        return 2;
+    }
+    if(settings.qmcScrambles != 0 && settings.antitheticGeometry) {
+        // A pair's partner replays its first photon's pseudo-random split, not its Sobol point
+        fprintf(stderr, "--qmc can't be combined with --antithetic\n");
+        usage(programName);
+        return 2;
+    }
+
+    char *sampleFilename = argv[optind];
+    char *outputFilename = argv[optind+1];
+
+    // Cached photons are only reusable by runs that draw the same ones, and common random numbers
+    // are only common between runs that share a seed, so don't pick a fresh one
+    if((cacheDirectory != NULL || settings.commonRandomNumbers) && !seedGiven) {
+        settings.seed = 0;
+    }
+    ResultCache *cache = cacheDirectory != NULL ? new ResultCache(cacheDirectory) : NULL;
+
+    if(batch) {
+        retcode = runBatch(sampleFilename, outputFilename, model, datadir, numThreads, scatteringLevels, cache, pathLengths, settings);
+        delete cache;
+        return retcode;
+    }
+
+    sampleFile = fopen(sampleFilename, "r");
+    if(sampleFile == NULL) {
+        fprintf(stderr, "Error while opening '%s'", sampleFilename);
+        delete cache;
+        return 1;
+    }
+
+    outputFile = fopen(outputFilename, "w");
+    if(outputFile == NULL) {
+        fprintf(stderr, "Error while opening output '%s'", outputFilename);
+        fclose(sampleFile);
+        delete cache;
+        return 1;
+    }
+
+    if(parseSampleFromFile(&sample, sampleFile)) {
+        Simulator simulator(datadir, numThreads, scatteringLevels);
+        simulator.setCache(cache);
+
+        OutputFormat format;
+        format.batch = false;
+        format.standardErrors = settings.targetStderr > 0 || settings.qmcScrambles > 0 || settings.controlVariate;
+        format.controlGain = settings.controlVariate;
+        format.jacobian = settings.jacobian ? &simulator : NULL;
+        writeHeader(outputFile, format);
+
+        fprintf(stderr, "Running simulation (%d samples, wavelengths %dnm-%dnm, seed %lu)...\n",
+                settings.numSamples, settings.wavelengthStart, settings.wavelengthEnd, settings.seed);
+
+        std::vector<SpectrumPoint> spectrum = pathLengths ?
+            simulator.evaluatePaths(sample, model, simulator.tracePaths(sample, model, settings)) :
+            simulator.simulate(sample, model, settings);
+
+        //Spit results
+        writeSpectrum(outputFile, NULL, spectrum, format);
+    } else {
+        fprintf(stderr, "Error while parsing sample json\n");
+        retcode = 1;
+    }
+
+    fclose(outputFile);
+    fclose(sampleFile);
+    delete cache;
+
+    return retcode;
+}
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "executor.h"
+
+#define STEAL_EMPTY   0
+#define STEAL_SUCCESS 1
+#define STEAL_ABORT   2
+
+struct WorkerStart {
+    Executor *executor;
+    int workerIndex;
+};
+
+Executor::Executor(int numThreads) :
+    numThreads(numThreads > 0 ? numThreads : detectProcessors()),
+    generation(0),
+    busyWorkers(0),
+    shuttingDown(false),
+    job(NULL)
+{
+    pthread_mutex_init(&runMutex, NULL);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&startCondition, NULL);
+    pthread_cond_init(&doneCondition, NULL);
+
+    deques = new WorkDeque[this->numThreads];
+    threads = new pthread_t[this->numThreads];
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    for(int i = 0; i < this->numThreads; i++) {
+        deques[i].top = 0;
+        deques[i].bottom = 0;
+
+        WorkerStart *start = new WorkerStart;
+        start->executor = this;
+        start->workerIndex = i;
+        if(pthread_create(&threads[i], &attr, workerMain, start) != 0) {
+            delete start;
+            pthread_attr_destroy(&attr);
+            throw std::runtime_error("Could not start worker thread");
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+Executor::~Executor() {
+    pthread_mutex_lock(&mutex);
+    shuttingDown = true;
+    pthread_cond_broadcast(&startCondition);
+    pthread_mutex_unlock(&mutex);
+
+    for(int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&doneCondition);
+    pthread_cond_destroy(&startCondition);
+    pthread_mutex_destroy(&mutex);
+    pthread_mutex_destroy(&runMutex);
+    delete []threads;
+    delete []deques;
+}
+
+int Executor::detectProcessors() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+void Executor::run(ExecutorJob &job, size_t numTasks) {
+    if(numTasks == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&runMutex);
+
+    // Workers pop from the bottom, so the lowest task indices go in last
+    for(int i = 0; i < numThreads; i++) {
+        WorkDeque &deque = deques[i];
+        deque.tasks.clear();
+        for(size_t task = i; task < numTasks; task += numThreads) {
+            deque.tasks.push_back(task);
+        }
+        std::reverse(deque.tasks.begin(), deque.tasks.end());
+        deque.top = 0;
+        deque.bottom = deque.tasks.size();
+    }
+
+    // The mutex publishes the filled deques to the workers
+    pthread_mutex_lock(&mutex);
+    this->job = &job;
+    busyWorkers = numThreads;
+    generation++;
+    pthread_cond_broadcast(&startCondition);
+    while(busyWorkers > 0) {
+        pthread_cond_wait(&doneCondition, &mutex);
+    }
+    this->job = NULL;
+    pthread_mutex_unlock(&mutex);
+
+    pthread_mutex_unlock(&runMutex);
+}
+
+void *Executor::workerMain(void *arg) {
+    WorkerStart *start = (WorkerStart *)arg;
+    Executor *executor = start->executor;
+    int workerIndex = start->workerIndex;
+    delete start;
+
+    executor->workerLoop(workerIndex);
+    return NULL;
+}
+
+void Executor::workerLoop(int workerIndex) {
+    unsigned long seenGeneration = 0;
+    pthread_mutex_lock(&mutex);
+    while(true) {
+        while(generation == seenGeneration && !shuttingDown) {
+            pthread_cond_wait(&startCondition, &mutex);
+        }
+        if(shuttingDown) {
+            break;
+        }
+        seenGeneration = generation;
+        pthread_mutex_unlock(&mutex);
+
+        work(workerIndex);
+
+        pthread_mutex_lock(&mutex);
+        if(--busyWorkers == 0) {
+            pthread_cond_signal(&doneCondition);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void Executor::work(int workerIndex) {
+    size_t taskIndex;
+    while(true) {
+        if(pop(deques[workerIndex], taskIndex)) {
+            job->runTask(taskIndex, workerIndex);
+            continue;
+        }
+
+        // Nothing is pushed during a run, so once every deque is empty the run is over
+        bool contended = false;
+        bool stole = false;
+        for(int i = 1; i < numThreads && !stole; i++) {
+            int result = steal(deques[(workerIndex + i) % numThreads], taskIndex);
+            if(result == STEAL_SUCCESS) {
+                stole = true;
+            } else if(result == STEAL_ABORT) {
+                contended = true;
+            }
+        }
+
+        if(stole) {
+            job->runTask(taskIndex, workerIndex);
+        } else if(!contended) {
+            break;
+        }
+    }
+}
+
+bool Executor::pop(WorkDeque &deque, size_t &taskIndex) {
+    long b = __atomic_load_n(&deque.bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque.bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&deque.top, __ATOMIC_RELAXED);
+
+    if(t > b) {
+        __atomic_store_n(&deque.bottom, b + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    taskIndex = deque.tasks[b];
+    if(t == b) {
+        // Last task: race any thief for it
+        bool won = __atomic_compare_exchange_n(&deque.top, &t, t + 1, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&deque.bottom, b + 1, __ATOMIC_RELAXED);
+        return won;
+    }
+    return true;
+}
+
+int Executor::steal(WorkDeque &deque, size_t &taskIndex) {
+    long t = __atomic_load_n(&deque.top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&deque.bottom, __ATOMIC_ACQUIRE);
+
+    if(t >= b) {
+        return STEAL_EMPTY;
+    }
+
+    taskIndex = deque.tasks[t];
+    if(!__atomic_compare_exchange_n(&deque.top, &t, t + 1, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return STEAL_ABORT;
+    }
+    return STEAL_SUCCESS;
+}
@@ -0,0 +1,319 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+
+#include "inversion.h"
+
+const FreeParameter sampleFields[] = {
+    {"wholeLeafThickness", &Sample::wholeLeafThickness, 0, 0},
+    {"cuticleUndulationsAspectRatio", &Sample::cuticleUndulationsAspectRatio, 0, 0},
+    {"epidermisCellCapsAspectRatio", &Sample::epidermisCellCapsAspectRatio, 0, 0},
+    {"spongyCellCapsAspectRatio", &Sample::spongyCellCapsAspectRatio, 0, 0},
+    {"palisadeCellCapsAspectRatio", &Sample::palisadeCellCapsAspectRatio, 0, 0},
+    {"proteinConcentration", &Sample::proteinConcentration, 0, 0},
+    {"celluloseConcentration", &Sample::celluloseConcentration, 0, 0},
+    {"linginConcentration", &Sample::linginConcentration, 0, 0},
+    {"chlorophyllAConcentration", &Sample::chlorophyllAConcentration, 0, 0},
+    {"chlorophyllBConcentration", &Sample::chlorophyllBConcentration, 0, 0},
+    {"carotenoidConcentration", &Sample::carotenoidConcentration, 0, 0},
+    {"mesophyllFraction", &Sample::mesophyllFraction, 0, 0},
+    {NULL, NULL, 0, 0}
+};
+
+bool parseFreeParameter(const char *spec, FreeParameter &parameter) {
+    const char *colon = strchr(spec, ':');
+    if(colon == NULL) {
+        return false;
+    }
+    std::string name(spec, colon - spec);
+    char *end;
+    parameter.lower = strtod(colon + 1, &end);
+    if(end == colon + 1 || *end != ':') {
+        return false;
+    }
+    const char *upper = end + 1;
+    parameter.upper = strtod(upper, &end);
+    if(end == upper || *end != '\0' || !(parameter.lower < parameter.upper)) {
+        return false;
+    }
+    for(int i = 0; sampleFields[i].name != NULL; i++) {
+        if(name == sampleFields[i].name) {
+            parameter.name = sampleFields[i].name;
+            parameter.field = sampleFields[i].field;
+            return true;
+        }
+    }
+    return false;
+}
+
+void writeSample(FILE *outputFile, const Sample &sample) {
+    fprintf(outputFile, "{\n");
+    for(int i = 0; sampleFields[i].name != NULL; i++) {
+        fprintf(outputFile, "    \"%s\": %.9g,\n", sampleFields[i].name, sample.*sampleFields[i].field);
+    }
+    fprintf(outputFile, "    \"bifacial\": %s\n}\n", sample.bifacial ? "true" : "false");
+}
+
+bool readMeasuredSpectrum(FILE *inputFile, MeasuredSpectrum &spectrum) {
+    char line[4096];
+    while(fgets(line, sizeof(line), inputFile) != NULL) {
+        int wavelength;
+        double reflectance, transmittance;
+        if(sscanf(line, " %d , %lf , %lf", &wavelength, &reflectance, &transmittance) != 3) {
+            continue;
+        }
+        if(!spectrum.wavelengths.empty() && wavelength <= spectrum.wavelengths.back()) {
+            fprintf(stderr, "Measured wavelengths must increase (%d after %d)\n", wavelength,
+                    spectrum.wavelengths.back());
+            return false;
+        }
+        spectrum.wavelengths.push_back(wavelength);
+        spectrum.reflectance.push_back(reflectance);
+        spectrum.transmittance.push_back(transmittance);
+    }
+    if(spectrum.wavelengths.empty()) {
+        fprintf(stderr, "No measurements found\n");
+        return false;
+    }
+    return true;
+}
+
+/* Keeps every spectrum of a batch, in sample order */
+class SpectrumStore : public SpectrumSink {
+    public:
+        SpectrumStore(size_t numSamples) : spectra(numSamples) {
+        }
+        virtual void sampleFinished(size_t sampleIndex, const std::vector<SpectrumPoint> &spectrum) {
+            spectra[sampleIndex] = spectrum;
+        }
+        std::vector<std::vector<SpectrumPoint> > spectra;
+};
+
+/* Evaluates candidate samples against the measurements, all on the same photons */
+class MisfitEvaluator {
+    public:
+        MisfitEvaluator(Simulator &simulator, ModelType model, const MeasuredSpectrum &measured,
+                const SpectrumSettings &base, bool pathLengths) :
+            simulator(simulator),
+            model(model),
+            measured(measured),
+            settings(base),
+            pathLengths(pathLengths)
+        {
+            settings.verbose = false;
+            // Simulate the smallest evenly spaced range holding every measured wavelength
+            const std::vector<int> &wavelengths = measured.wavelengths;
+            int step = 0;
+            for(size_t i = 1; i < wavelengths.size(); i++) {
+                int a = step, b = wavelengths[i] - wavelengths[0];
+                while(b != 0) {
+                    int t = a % b;
+                    a = b;
+                    b = t;
+                }
+                step = a;
+            }
+            settings.wavelengthStart = wavelengths.front();
+            settings.wavelengthEnd = wavelengths.back();
+            settings.step = step > 0 ? step : 1;
+        }
+
+        void setNumSamples(int numSamples, const Sample &morphology) {
+            settings.numSamples = numSamples;
+            if(pathLengths) {
+                paths = simulator.tracePaths(morphology, model, settings);
+            }
+        }
+        int numSamples() const {
+            return settings.numSamples;
+        }
+
+        /* Residuals (model - measured) of each candidate, R and T interleaved */
+        std::vector<std::vector<double> > residuals(const std::vector<Sample> &candidates) {
+            std::vector<std::vector<SpectrumPoint> > spectra;
+            if(pathLengths) {
+                for(size_t i = 0; i < candidates.size(); i++) {
+                    spectra.push_back(simulator.evaluatePaths(candidates[i], model, paths));
+                }
+            } else {
+                SpectrumStore store(candidates.size());
+                simulator.simulateBatch(candidates, model, settings, store);
+                spectra.swap(store.spectra);
+            }
+
+            std::vector<std::vector<double> > result(candidates.size());
+            for(size_t i = 0; i < candidates.size(); i++) {
+                for(size_t w = 0; w < measured.wavelengths.size(); w++) {
+                    const size_t index = (measured.wavelengths[w] - settings.wavelengthStart) / settings.step;
+                    const ReflectPair rt = spectra[i][index].reflectance();
+                    result[i].push_back(rt.first - measured.reflectance[w]);
+                    result[i].push_back(rt.second - measured.transmittance[w]);
+                }
+            }
+            return result;
+        }
+
+    private:
+        Simulator &simulator;
+        ModelType model;
+        const MeasuredSpectrum &measured;
+        SpectrumSettings settings;
+        bool pathLengths;
+        std::vector<PathPoint> paths;
+};
+
+static double sumOfSquares(const std::vector<double> &r) {
+    double sum = 0;
+    for(size_t i = 0; i < r.size(); i++) {
+        sum += r[i]*r[i];
+    }
+    return sum;
+}
+
+/* Solves the n x n system a x = b in place by Gaussian elimination with partial pivoting */
+static void solveLinear(std::vector<double> &a, std::vector<double> &b, int n) {
+    for(int col = 0; col < n; col++) {
+        int pivot = col;
+        for(int row = col + 1; row < n; row++) {
+            if(fabs(a[row*n + col]) > fabs(a[pivot*n + col])) {
+                pivot = row;
+            }
+        }
+        if(pivot != col) {
+            for(int k = 0; k < n; k++) {
+                std::swap(a[col*n + k], a[pivot*n + k]);
+            }
+            std::swap(b[col], b[pivot]);
+        }
+        for(int row = col + 1; row < n; row++) {
+            const double factor = a[row*n + col] / a[col*n + col];
+            for(int k = col; k < n; k++) {
+                a[row*n + k] -= factor * a[col*n + k];
+            }
+            b[row] -= factor * b[col];
+        }
+    }
+    for(int row = n - 1; row >= 0; row--) {
+        for(int k = row + 1; k < n; k++) {
+            b[row] -= a[row*n + k] * b[k];
+        }
+        b[row] /= a[row*n + row];
+    }
+}
+
+/* Finite-difference step, as a fraction of each parameter's range */
+#define JACOBIAN_STEP 0.01
+#define MAX_DAMPING 1e8
+
+InversionResult invertSpectrum(Simulator &simulator, ModelType model, const Sample &initial,
+        const std::vector<FreeParameter> &parameters, const MeasuredSpectrum &measured,
+        const SpectrumSettings &settings, const InversionSettings &inversion) {
+    const int n = parameters.size();
+    MisfitEvaluator evaluator(simulator, model, measured, settings, inversion.pathLengths);
+    const bool monteCarlo = settings.solver == SOLVER_MONTE_CARLO;
+
+    // Work in x in [0,1]^n so one damping suits parameters of every scale
+    std::vector<double> x(n);
+    for(int j = 0; j < n; j++) {
+        const FreeParameter &p = parameters[j];
+        x[j] = std::min(std::max((initial.*p.field - p.lower) / (p.upper - p.lower), 0.0), 1.0);
+    }
+    Sample current = initial;
+    for(int j = 0; j < n; j++) {
+        const FreeParameter &p = parameters[j];
+        current.*p.field = p.lower + x[j] * (p.upper - p.lower);
+    }
+
+    evaluator.setNumSamples(monteCarlo ? std::min(inversion.initialSamples, settings.numSamples) : settings.numSamples,
+            current);
+    std::vector<double> r = evaluator.residuals(std::vector<Sample>(1, current))[0];
+    double cost = sumOfSquares(r);
+    const size_t m = r.size();
+    double damping = 1e-2;
+
+    int iteration = 0;
+    while(iteration < inversion.maxIterations) {
+        iteration++;
+
+        // Forward differences, stepping inwards at the upper bound
+        std::vector<Sample> probes(n, current);
+        std::vector<double> steps(n);
+        for(int j = 0; j < n; j++) {
+            const FreeParameter &p = parameters[j];
+            steps[j] = x[j] + JACOBIAN_STEP <= 1 ? JACOBIAN_STEP : -JACOBIAN_STEP;
+            probes[j].*p.field = p.lower + (x[j] + steps[j]) * (p.upper - p.lower);
+        }
+        std::vector<std::vector<double> > probed = evaluator.residuals(probes);
+        std::vector<double> jacobian(m * n);
+        for(int j = 0; j < n; j++) {
+            for(size_t i = 0; i < m; i++) {
+                jacobian[i*n + j] = (probed[j][i] - r[i]) / steps[j];
+            }
+        }
+        std::vector<double> normal(n * n, 0.0), gradient(n, 0.0);
+        for(size_t i = 0; i < m; i++) {
+            for(int j = 0; j < n; j++) {
+                gradient[j] += jacobian[i*n + j] * r[i];
+                for(int k = 0; k < n; k++) {
+                    normal[j*n + k] += jacobian[i*n + j] * jacobian[i*n + k];
+                }
+            }
+        }
+
+        // Raise the damping until a step lowers the misfit
+        bool improved = false;
+        double previousCost = cost;
+        while(damping < MAX_DAMPING) {
+            std::vector<double> a(normal), delta(n);
+            for(int j = 0; j < n; j++) {
+                a[j*n + j] += damping * std::max(normal[j*n + j], 1e-12);
+                delta[j] = -gradient[j];
+            }
+            solveLinear(a, delta, n);
+
+            std::vector<double> trialX(n);
+            Sample trial = current;
+            for(int j = 0; j < n; j++) {
+                const FreeParameter &p = parameters[j];
+                trialX[j] = std::min(std::max(x[j] + delta[j], 0.0), 1.0);
+                trial.*p.field = p.lower + trialX[j] * (p.upper - p.lower);
+            }
+            std::vector<double> trialR = evaluator.residuals(std::vector<Sample>(1, trial))[0];
+            const double trialCost = sumOfSquares(trialR);
+            if(trialCost < cost) {
+                x = trialX;
+                current = trial;
+                r = trialR;
+                cost = trialCost;
+                damping = std::max(damping / 3, 1e-7);
+                improved = true;
+                break;
+            }
+            damping *= 4;
+        }
+
+        fprintf(stderr, "Iteration %d\t misfit %f (%d samples)\n", iteration, sqrt(cost / m), evaluator.numSamples());
+        if(improved && previousCost - cost > inversion.tolerance * previousCost) {
+            continue;
+        }
+
+        // Stalled: the remaining gains are within the noise, so look closer or stop
+        if(!monteCarlo || evaluator.numSamples() >= settings.numSamples) {
+            break;
+        }
+        evaluator.setNumSamples(std::min(2 * evaluator.numSamples(), settings.numSamples), current);
+        r = evaluator.residuals(std::vector<Sample>(1, current))[0];
+        cost = sumOfSquares(r);
+        damping = 1e-2;
+    }
+
+    InversionResult result;
+    result.sample = current;
+    result.misfit = sqrt(cost / m);
+    result.iterations = iteration;
+    result.numSamples = evaluator.numSamples();
+    return result;
+}
@@ -0,0 +1,327 @@
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "abm_interfaces.h"
+#include "markov_solver.h"
+
+double fresnellCoefficient(const vec3 &vector, const vec3 &normal, double cosI, double n1, double n2);
+
+/* Gauss-Legendre points inside each bin; the chain assumes cos(theta) is uniform within a bin */
+#define BIN_NODES 3
+/* Gauss-Legendre points per sample parameter */
+#define PARAMETER_NODES 8
+
+/* Nodes and weights of n-point Gauss-Legendre quadrature on [0,1] */
+static void gaussLegendre(int n, std::vector<double> &nodes, std::vector<double> &weights) {
+    nodes.resize(n);
+    weights.resize(n);
+    for(int i = 0; i < n; i++) {
+        double x = cos(M_PI * (i + 0.75) / (n + 0.5));
+        double derivative = 1;
+        for(int iteration = 0; iteration < 100; iteration++) {
+            double p0 = 1, p1 = x;
+            for(int k = 2; k <= n; k++) {
+                const double p2 = ((2*k - 1) * x * p1 - (k - 1) * p0) / k;
+                p0 = p1;
+                p1 = p2;
+            }
+            derivative = n * (x * p1 - p0) / (x*x - 1);
+            const double step = p1 / derivative;
+            x -= step;
+            if(fabs(step) < 1e-15) {
+                break;
+            }
+        }
+        nodes[i] = (1 - x) / 2;
+        weights[i] = 1 / ((1 - x*x) * derivative * derivative);
+    }
+}
+
+/*
+ * Distribution of |z| after Brakke scattering around an axis with |z| = v,
+ * tabulated at v = 0, 1/bins, ..., 1 and interpolated in between. Each row
+ * integrates the lobe in t = mu^(delta+1), where it is uniform, and the
+ * azimuth analytically: at a given mu the output |z| = mu*v + sin*cos(psi)*h
+ * falls in a bin for a known arc of psi, and azimuths giving |z| < 0 are the
+ * ones the tracer rejects.
+ */
+class BrakkeKernel {
+    public:
+        BrakkeKernel(double delta, int bins) : bins(bins), rows((bins + 1) * bins) {
+            const double exponent = 1/(delta+1);
+            const int steps = 32 * bins;
+            std::vector<double> above(bins + 1);
+            for(int row = 0; row <= bins; row++) {
+                const double vertical = (double)row / bins;
+                const double horizontal = sqrt(std::max(0.0, 1 - vertical*vertical));
+                double *out = &rows[row * bins];
+                for(int k = 0; k < steps; k++) {
+                    const double mu = pow((k + 0.5) / steps, exponent);
+                    const double spread = sqrt(std::max(0.0, 1 - mu*mu)) * horizontal;
+                    if(spread < 1e-12) {
+                        out[std::min((int)(mu * vertical * bins), bins - 1)] += 1;
+                        continue;
+                    }
+                    // Fraction of azimuths in [0, pi] putting |z| at or above each bin edge
+                    for(int edge = 0; edge <= bins; edge++) {
+                        const double c = ((double)edge / bins - mu * vertical) / spread;
+                        above[edge] = acos(std::max(-1.0, std::min(1.0, c))) / M_PI;
+                    }
+                    for(int bin = 0; bin < bins; bin++) {
+                        out[bin] += above[bin] - above[bin + 1];
+                    }
+                }
+                double total = 0;
+                for(int bin = 0; bin < bins; bin++) {
+                    total += out[bin];
+                }
+                for(int bin = 0; bin < bins; bin++) {
+                    out[bin] /= total;
+                }
+            }
+        }
+
+        /* Adds weight times the distribution for axis v to out[0..bins) */
+        void add(double v, double weight, double *out) const {
+            const double x = v * bins;
+            const int row = std::max(0, std::min((int)x, bins - 1));
+            const double f = std::max(0.0, std::min(1.0, x - row));
+            const double *r0 = &rows[row * bins];
+            const double *r1 = r0 + bins;
+            for(int bin = 0; bin < bins; bin++) {
+                out[bin] += weight * ((1-f) * r0[bin] + f * r1[bin]);
+            }
+        }
+
+    private:
+        int bins;
+        std::vector<double> rows;
+};
+
+MarkovSolver::MarkovSolver(int bins) : bins(bins) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+MarkovSolver::~MarkovSolver() {
+    for(std::map<double, BrakkeKernel *>::iterator it = kernels.begin(); it != kernels.end(); it++) {
+        delete it->second;
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+const BrakkeKernel *MarkovSolver::kernel(double delta) {
+    if(delta == INFINITY) {
+        return NULL;
+    }
+    pthread_mutex_lock(&mutex);
+    BrakkeKernel *&kernel = kernels[delta];
+    if(kernel == NULL) {
+        kernel = new BrakkeKernel(delta, bins);
+    }
+    pthread_mutex_unlock(&mutex);
+    return kernel;
+}
+
+/* One configuration of the chain: states are (interface, direction, bin) */
+class MarkovChain {
+    public:
+        MarkovChain(const std::vector<const BrakkeKernel *> &reflectKernels,
+                const std::vector<const BrakkeKernel *> &refractKernels, const StartingGeometry &geometry,
+                bool disableSieve, InterfaceList &interfaceList, int bins) :
+            reflectKernels(reflectKernels),
+            refractKernels(refractKernels),
+            geometry(geometry),
+            disableSieve(disableSieve),
+            interfaceList(interfaceList),
+            numInterfaces(interfaceList.size()),
+            bins(bins)
+        {
+        }
+
+        int index(int state, int dir, int bin) const {
+            return (2*state + dir) * bins + bin;
+        }
+        int size() const {
+            return 2 * numInterfaces * bins;
+        }
+
+        /*
+         * Adds to row the chance, times weight, that a photon arriving at state travelling in dir with
+         * cos(theta) = mu next arrives at each state, and to exitR and exitT the chance it leaves the leaf
+         */
+        void event(int state, int dir, double mu, double weight, double *row, double &exitR, double &exitT) const {
+            const InterfaceSide &side = interfaceList.side(state, dir);
+            const vec3 normal(0, 0, dir == DIRECTION_DOWN ? 1.0 : -1.0);
+
+            double survival = 1;
+            if(side.thickness > 0) {
+                // The tracer's free path, including its treatment of the sieve effect
+                survival = exp(-side.absorption * side.thickness / (disableSieve ? mu : cos(mu)));
+            }
+            const double reflectance = fresnellCoefficient(vec3(0, 0, -mu * normal.z), normal, mu, side.n1, side.n2);
+
+            const int index = 2*state + dir;
+            deposit(side.reflectState, 1 - dir, mu, reflectKernels[index], weight * survival * reflectance,
+                    row, exitR, exitT);
+            if(reflectance < 1) {
+                const double n = side.n1 / side.n2;
+                const double refracted = sqrt(std::max(0.0, 1 - n*n*(1 - mu*mu)));
+                deposit(side.refractState, dir, refracted, refractKernels[index], weight * survival * (1 - reflectance),
+                        row, exitR, exitT);
+            }
+        }
+
+    private:
+        void deposit(int state, int dir, double mu, const BrakkeKernel *kernel, double weight,
+                double *row, double &exitR, double &exitT) const {
+            if(state == geometry.reflectedState) {
+                exitR += weight;
+            } else if(state == geometry.transmittedState) {
+                exitT += weight;
+            } else if(kernel != NULL) {
+                kernel->add(mu, weight, &row[index(state, dir, 0)]);
+            } else {
+                // Unperturbed: split between the two nearest bin centres
+                const double x = std::max(0.0, std::min((double)bins - 1, mu * bins - 0.5));
+                const int bin = std::min((int)x, bins - 2 < 0 ? 0 : bins - 2);
+                const double f = x - bin;
+                row[index(state, dir, bin)] += weight * (1 - f);
+                if(f > 0) {
+                    row[index(state, dir, bin + 1)] += weight * f;
+                }
+            }
+        }
+
+        const std::vector<const BrakkeKernel *> &reflectKernels;
+        const std::vector<const BrakkeKernel *> &refractKernels;
+        const StartingGeometry &geometry;
+        bool disableSieve;
+        InterfaceList &interfaceList;
+        int numInterfaces;
+        int bins;
+};
+
+/* Solves a x = b for two right-hand sides in place by Gaussian elimination with partial pivoting */
+static void solveLinear(std::vector<double> &a, std::vector<double> &b0, std::vector<double> &b1, int n) {
+    for(int k = 0; k < n; k++) {
+        int pivot = k;
+        for(int i = k + 1; i < n; i++) {
+            if(fabs(a[i*n + k]) > fabs(a[pivot*n + k])) {
+                pivot = i;
+            }
+        }
+        if(pivot != k) {
+            std::swap_ranges(a.begin() + k*n, a.begin() + (k+1)*n, a.begin() + pivot*n);
+            std::swap(b0[k], b0[pivot]);
+            std::swap(b1[k], b1[pivot]);
+        }
+        const double diagonal = a[k*n + k];
+        if(diagonal == 0) {
+            continue;
+        }
+        const double *pivotRow = &a[k*n];
+        for(int i = k + 1; i < n; i++) {
+            double *target = &a[i*n];
+            const double factor = target[k] / diagonal;
+            if(factor == 0) {
+                continue;
+            }
+            for(int j = k; j < n; j++) {
+                target[j] -= factor * pivotRow[j];
+            }
+            b0[i] -= factor * b0[k];
+            b1[i] -= factor * b1[k];
+        }
+    }
+    for(int k = n - 1; k >= 0; k--) {
+        const double diagonal = a[k*n + k];
+        double s0 = b0[k], s1 = b1[k];
+        for(int j = k + 1; j < n; j++) {
+            s0 -= a[k*n + j] * b0[j];
+            s1 -= a[k*n + j] * b1[j];
+        }
+        b0[k] = diagonal != 0 ? s0 / diagonal : 0;
+        b1[k] = diagonal != 0 ? s1 / diagonal : 0;
+    }
+}
+
+ReflectPair MarkovSolver::solve(double azimuthalAngle, double polarAngle, bool disableSieve, InterfaceList &interfaceList) {
+    const int numInterfaces = interfaceList.size();
+    const StartingGeometry geometry = startingGeometry(azimuthalAngle, polarAngle, numInterfaces);
+
+    std::vector<const BrakkeKernel *> reflectKernels(2 * numInterfaces), refractKernels(2 * numInterfaces);
+    for(int state = 0; state < numInterfaces; state++) {
+        for(int dir = 0; dir < 2; dir++) {
+            const InterfaceSide &side = interfaceList.side(state, dir);
+            reflectKernels[2*state + dir] = kernel(side.perturbanceReflect);
+            refractKernels[2*state + dir] = kernel(side.perturbanceRefract);
+        }
+    }
+
+    std::vector<double> binNodes, binWeights, parameterNodes, parameterWeights;
+    gaussLegendre(BIN_NODES, binNodes, binWeights);
+    gaussLegendre(PARAMETER_NODES, parameterNodes, parameterWeights);
+
+    // Tensor-product quadrature over the per-sample parameters
+    const int numParameters = interfaceList.numSampleParameters();
+    int numConfigurations = 1;
+    for(int p = 0; p < numParameters; p++) {
+        numConfigurations *= PARAMETER_NODES;
+    }
+
+    const MarkovChain chain(reflectKernels, refractKernels, geometry, disableSieve, interfaceList, bins);
+    const int n = chain.size();
+    const int startDir = geometry.direction.z < 0 ? DIRECTION_DOWN : DIRECTION_UP;
+    const double startMu = fabs(geometry.direction.z);
+    std::vector<double> a(n * n), toReflected(n), toTransmitted(n), first(n);
+    std::vector<double> u(std::max(numParameters, 1));
+    ReflectPair result(0, 0);
+
+    for(int configuration = 0; configuration < numConfigurations; configuration++) {
+        double configurationWeight = 1;
+        for(int p = 0, rest = configuration; p < numParameters; p++, rest /= PARAMETER_NODES) {
+            u[p] = parameterNodes[rest % PARAMETER_NODES];
+            configurationWeight *= parameterWeights[rest % PARAMETER_NODES];
+        }
+        if(numParameters > 0) {
+            interfaceList.setSampleParameters(&u[0]);
+        }
+
+        // a = I - P, where row i of P holds the chances of moving from state i to each state
+        std::fill(a.begin(), a.end(), 0.0);
+        std::fill(toReflected.begin(), toReflected.end(), 0.0);
+        std::fill(toTransmitted.begin(), toTransmitted.end(), 0.0);
+        for(int state = 0; state < numInterfaces; state++) {
+            for(int dir = 0; dir < 2; dir++) {
+                for(int bin = 0; bin < bins; bin++) {
+                    const int i = chain.index(state, dir, bin);
+                    for(int node = 0; node < BIN_NODES; node++) {
+                        chain.event(state, dir, (bin + binNodes[node]) / bins, binWeights[node], &a[i*n],
+                                toReflected[i], toTransmitted[i]);
+                    }
+                }
+            }
+        }
+        for(int i = 0; i < n; i++) {
+            for(int j = 0; j < n; j++) {
+                a[i*n + j] = -a[i*n + j];
+            }
+            a[i*n + i] += 1;
+        }
+        // Afterwards toReflected[i] is the chance of eventually leaving by reflection from state i
+        solveLinear(a, toReflected, toTransmitted, n);
+
+        // The first event starts from the exact incident angle rather than a bin
+        std::fill(first.begin(), first.end(), 0.0);
+        double reflected = 0, transmitted = 0;
+        chain.event(geometry.startState, startDir, startMu, 1, &first[0], reflected, transmitted);
+        for(int i = 0; i < n; i++) {
+            reflected += first[i] * toReflected[i];
+            transmitted += first[i] * toTransmitted[i];
+        }
+        result.first += configurationWeight * reflected;
+        result.second += configurationWeight * transmitted;
+    }
+    return result;
+}
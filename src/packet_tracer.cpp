@@ -0,0 +1,387 @@
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "abm_interfaces.h"
+#include "random_stream.h"
+#include "run_abm.h"
+#include "scattering_table.h"
+
+/* Photons traced side by side, one per lane of the vectors below */
+#define PACKET_WIDTH 8
+
+/* First Philox block of a photon's event draws; RandomStream never gets this far into a substream */
+#define EVENT_BLOCK 0x80000000ULL
+
+typedef double vdouble __attribute__((vector_size(PACKET_WIDTH * sizeof(double))));
+typedef int64_t vlong __attribute__((vector_size(PACKET_WIDTH * sizeof(int64_t))));
+typedef uint64_t vulong __attribute__((vector_size(PACKET_WIDTH * sizeof(uint64_t))));
+typedef uint32_t vuint __attribute__((vector_size(PACKET_WIDTH * sizeof(uint32_t))));
+
+/*
+ * The tracer is compiled for AVX-512 and AVX2 besides the baseline and the
+ * loader picks the widest the processor has, so plain builds use it too.
+ * Comparisons of vectors give lanes of all ones (true) or zeros (false).
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define PACKET_KERNEL __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define PACKET_KERNEL
+#endif
+#define LANES static inline __attribute__((always_inline))
+
+LANES vdouble splat(double x) {
+    return (vdouble){} + x;
+}
+
+LANES bool any(vlong mask) {
+    int64_t bits = 0;
+    for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+        bits |= mask[lane];
+    }
+    return bits != 0;
+}
+
+LANES vdouble vsqrt(vdouble x) {
+    vdouble root;
+    for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+        root[lane] = sqrt(x[lane]);
+    }
+    return root;
+}
+
+LANES vdouble vabs(vdouble x) {
+    return x < 0 ? -x : x;
+}
+
+/* Exact double of integers between -2^51 and 2^51, without a conversion instruction */
+LANES vdouble toDouble(vlong x) {
+    return (vdouble)(x + 0x4338000000000000LL) - 6755399441055744.0;
+}
+
+/* e^x, to within an ulp or two, for x <= 0; Cephes' exp */
+LANES vdouble vexp(vdouble x) {
+    const vdouble magic = splat(6755399441055744.0);
+    const vlong underflow = x < -708.0;
+    const vdouble clamped = underflow ? splat(-708.0) : x;
+    const vdouble t = clamped * 1.4426950408889634073599 + magic;
+    const vdouble n = t - magic;
+    const vdouble r = clamped - n * 6.93145751953125E-1 - n * 1.42860682030941723212E-6;
+    const vdouble rr = r * r;
+    const vdouble p = r * ((1.26177193074810590878E-4 * rr + 3.02994407707441961300E-2) * rr + 9.99999999999999999910E-1);
+    const vdouble q = ((3.00198505138664455042E-6 * rr + 2.52448340349684104192E-3) * rr + 2.27265548208155028766E-1) * rr +
+        2.00000000000000000009E0;
+    const vdouble scale = (vdouble)(((vlong)t - (vlong)magic + 1023) << 52);
+    return underflow ? splat(0) : (1 + 2 * (p / (q - p))) * scale;
+}
+
+/* Natural log, to within an ulp or two, for normal x > 0, and -inf for 0; Cephes' log */
+LANES vdouble vlog(vdouble x) {
+    const vlong bits = (vlong)x;
+    vlong exponent = ((bits >> 52) & 0x7FF) - 1022;
+    vdouble m = (vdouble)((bits & 0x000FFFFFFFFFFFFFLL) | 0x3FE0000000000000LL);
+    const vlong low = m < 0.70710678118654752440;
+    exponent += low;
+    m = low ? m + m - 1.0 : m - 1.0;
+    const vdouble e = toDouble(exponent);
+    const vdouble mm = m * m;
+    const vdouble p = ((((1.01875663804580931796E-4 * m + 4.97494994976747001425E-1) * m + 4.70579119878881725854E0) * m +
+            1.44989225341610930846E1) * m + 1.79368678507819816313E1) * m + 7.70838733755885391666E0;
+    const vdouble q = ((((m + 1.12873587189167450590E1) * m + 4.52279145837532221105E1) * m + 8.29875266912776603211E1) * m +
+            7.11544750618563894466E1) * m + 2.31251620126765340583E1;
+    const vdouble y = m * mm * (p / q) - e * 2.121944400546905827679E-4 - 0.5 * mm;
+    const vdouble result = m + y + e * 0.693359375;
+    return x > 0 ? result : splat(-INFINITY);
+}
+
+/* cos(x) for |x| <= pi/2, by its Taylor series to x^20 */
+LANES vdouble vcosSmall(vdouble x) {
+    const vdouble xx = x * x;
+    vdouble c = splat(1.0 / 2432902008176640000.0);
+    const double coefficients[10] = {
+        -1.0 / 6402373705728000.0, 1.0 / 20922789888000.0, -1.0 / 87178291200.0, 1.0 / 479001600.0,
+        -1.0 / 3628800.0, 1.0 / 40320.0, -1.0 / 720.0, 1.0 / 24.0, -1.0 / 2.0, 1.0
+    };
+    for(int k = 0; k < 10; k++) {
+        c = c * xx + coefficients[k];
+    }
+    return c;
+}
+
+/* cos(2*pi*u) for u in [0,1) */
+LANES vdouble vcos2pi(vdouble u) {
+    const vdouble a = vabs(u >= 0.5 ? u - 1.0 : u);
+    const vlong flip = a > 0.25;
+    const vdouble c = vcosSmall((flip ? 0.5 - a : a) * (2 * M_PI));
+    return flip ? -c : c;
+}
+
+/* RandomStream's uniform() of a Philox output word */
+LANES vdouble unit(vulong word) {
+    return ((vdouble)(word | 0x4330000000000000ULL) - 4503599627370496.0) * (1.0 / 4294967296.0);
+}
+
+/* Philox4x32-10 of each lane's (block, photon) in one stream, as RandomStream::refill computes it */
+LANES void philox(vulong block, vulong photon, uint32_t stream0, uint32_t stream1, uint32_t key0, uint32_t key1,
+        vdouble u[4]) {
+    const uint64_t low = 0xFFFFFFFFULL;
+    vulong c0 = block & low, c1 = photon, c2 = (vulong){} + stream0, c3 = (vulong){} + stream1;
+    for(int round = 0; round < PHILOX_ROUNDS; round++) {
+        const vulong p0 = (c0 & low) * (uint64_t)PHILOX_M0;
+        const vulong p1 = (c2 & low) * (uint64_t)PHILOX_M1;
+        c0 = (p1 >> 32) ^ c1 ^ key0;
+        c1 = p1 & low;
+        c2 = (p0 >> 32) ^ c3 ^ key1;
+        c3 = p0 & low;
+        key0 += PHILOX_W0;
+        key1 += PHILOX_W1;
+    }
+    u[0] = unit(c0);
+    u[1] = unit(c1);
+    u[2] = unit(c2);
+    u[3] = unit(c3);
+}
+
+/* SobolSequence::scramble of each lane's coordinate and seed */
+LANES vdouble scramble(vuint x, vuint seed) {
+    x += seed;
+    x ^= x * OWEN_M0;
+    x ^= x * OWEN_M1;
+    x ^= x * OWEN_M2;
+    x ^= x * OWEN_M3;
+    x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+    x = ((x >> 8) & 0x00FF00FFU) | ((x & 0x00FF00FFU) << 8);
+    return unit(__builtin_convertvector((x >> 16) | (x << 16), vulong));
+}
+
+/*
+ * Packet tracer: the reduced-state walk of runABMReduced for PACKET_WIDTH
+ * photons at once, one per SIMD lane. Every pass applies one event to all
+ * live lanes: the absorption test as u > exp(-absorption * depth), Fresnel,
+ * reflection or refraction of z, and exact Brakke scattering with its
+ * rejection loop run masked until every lane has accepted. Lanes whose
+ * photon ends are refilled with the next one, so the packet stays full.
+ *
+ * Geometry parameters and roulette still draw from each photon's
+ * RandomStream substream, but event draws come from Philox run on all lanes
+ * at once: one block of four uniforms per event (absorption, Fresnel and
+ * the two scattering draws) and one per rejected scattering attempt,
+ * numbered from EVENT_BLOCK within the photon's substream. Tallies are
+ * therefore independent of how photons fall into lanes or tasks, and agree
+ * with the scalar tracers within the noise rather than photon for photon.
+ * Under --qmc each photon's Sobol point is scrambled once, PACKET_WIDTH
+ * dimensions at a time, and a block's four uniforms are replaced lane by lane
+ * by the coordinates of the event's EVENT_DIMENSIONS sample dimensions.
+ * Scattering tables are sampled lane by lane.
+ */
+PACKET_KERNEL
+ReflectTally runABMPacket(int nSamples, double azimuthalAngle,
+        double polarAngle, bool disableSieve, InterfaceList &interfaceList, RandomStream &rng, int rouletteEvents) {
+    const int numInterfaces = interfaceList.size();
+    const StartingGeometry geometry = startingGeometry(azimuthalAngle, polarAngle, numInterfaces);
+    ReflectTally tally;
+    tally.firstSurfaceReflectance = firstSurfaceReflectance(geometry, interfaceList);
+
+    const uint32_t key0 = rng.keyWord(0), key1 = rng.keyWord(1);
+    const uint32_t stream0 = rng.counterWord(2), stream1 = rng.counterWord(3);
+    const int numParameters = interfaceList.numSampleParameters();
+    /* Under --qmc, the scramble seeds of the Sobol dimensions, PACKET_WIDTH at a time (SOBOL_DIMENSIONS
+       is a multiple of it) */
+    const SobolSequence *sequence = rng.sobolSequence();
+    vuint seeds[SOBOL_DIMENSIONS / PACKET_WIDTH];
+    if(sequence != NULL) {
+        memcpy(seeds, sequence->seeds(), sizeof(seeds));
+    }
+
+    /* ABM-U draws per-photon geometry in prepareForSample, so every lane keeps its own table */
+    const int tableSize = 2 * numInterfaces;
+    std::vector<InterfaceSide> tables(PACKET_WIDTH * tableSize);
+    bool tabulated = false;
+    for(int i = 0; i < tableSize; i++) {
+        const InterfaceSide &side = interfaceList.sideTable()[i];
+        tabulated = tabulated || (side.perturbanceReflect != INFINITY && interfaceList.scatteringTable(side.perturbanceReflect)) ||
+            (side.perturbanceRefract != INFINITY && interfaceList.scatteringTable(side.perturbanceRefract));
+    }
+
+    RandomStream laneRng[PACKET_WIDTH];
+    /* Each lane's Sobol coordinates, then -1 for the dimensions drawn from Philox */
+    double quasiDraws[PACKET_WIDTH][SOBOL_DIMENSIONS + EVENT_DIMENSIONS];
+    for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+        for(int d = 0; d < SOBOL_DIMENSIONS + EVENT_DIMENSIONS; d++) {
+            quasiDraws[lane][d] = -1;
+        }
+    }
+    int events[PACKET_WIDTH], state[PACKET_WIDTH];
+    int reflectState[PACKET_WIDTH], refractState[PACKET_WIDTH];
+    double n1s[PACKET_WIDTH], n2s[PACKET_WIDTH], thicknesses[PACKET_WIDTH], absorptions[PACKET_WIDTH];
+    double reflectPerturbances[PACKET_WIDTH], refractPerturbances[PACKET_WIDTH];
+    vdouble z = {}, depth = {}, weight = {};
+    vulong block = {}, photon = {};
+    vlong active = {};
+
+    int nextSample = 0;
+    while(true) {
+        int numActive = 0;
+        for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+            if(!active[lane] && nextSample < nSamples) {
+                laneRng[lane] = rng;
+                rng.nextSubstream();
+                nextSample++;
+                interfaceList.prepareForSample(laneRng[lane]);
+                if(sequence != NULL) {
+                    for(int i = 0; i < SOBOL_DIMENSIONS / PACKET_WIDTH; i++) {
+                        vuint coordinates;
+                        memcpy(&coordinates, laneRng[lane].sobolCoordinates() + i * PACKET_WIDTH, sizeof(coordinates));
+                        const vdouble draws = scramble(coordinates, seeds[i]);
+                        memcpy(&quasiDraws[lane][i * PACKET_WIDTH], &draws, sizeof(draws));
+                    }
+                }
+                memcpy(&tables[lane * tableSize], interfaceList.sideTable(), tableSize * sizeof(InterfaceSide));
+                z[lane] = geometry.direction.z;
+                depth[lane] = 0;
+                weight[lane] = 1;
+                block[lane] = EVENT_BLOCK;
+                photon[lane] = laneRng[lane].substream();
+                events[lane] = 0;
+                state[lane] = geometry.startState;
+                active[lane] = -1;
+            }
+            numActive += active[lane] != 0;
+        }
+        if(numActive == 0) {
+            break;
+        }
+
+        for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+            if(active[lane] && ++events[lane] > rouletteEvents && rouletteEvents > 0) {
+                double w = weight[lane];
+                if(!surviveEventRoulette(events[lane], rouletteEvents, w, tally, laneRng[lane])) {
+                    tally.numAbsorbed++;
+                    tally.events.add(events[lane]);
+                    active[lane] = 0;
+                }
+                weight[lane] = w;
+            }
+        }
+
+        /* Gather each lane's side; idle lanes see a harmless air<->air interface */
+        for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+            const int dir = z[lane] < 0 ? DIRECTION_DOWN : DIRECTION_UP;
+            const InterfaceSide &side = tables[lane * tableSize + 2 * (active[lane] ? state[lane] : 0) + dir];
+            n1s[lane] = active[lane] ? side.n1 : 1.0;
+            n2s[lane] = active[lane] ? side.n2 : 1.0;
+            thicknesses[lane] = active[lane] ? side.thickness : 0.0;
+            absorptions[lane] = side.absorption;
+            reflectPerturbances[lane] = side.perturbanceReflect;
+            refractPerturbances[lane] = side.perturbanceRefract;
+            reflectState[lane] = side.reflectState;
+            refractState[lane] = side.refractState;
+        }
+        vdouble n1, n2, thickness, absorption, perturbanceReflect, perturbanceRefract;
+        memcpy(&n1, n1s, sizeof(n1));
+        memcpy(&n2, n2s, sizeof(n2));
+        memcpy(&thickness, thicknesses, sizeof(thickness));
+        memcpy(&absorption, absorptions, sizeof(absorption));
+        memcpy(&perturbanceReflect, reflectPerturbances, sizeof(perturbanceReflect));
+        memcpy(&perturbanceRefract, refractPerturbances, sizeof(perturbanceRefract));
+
+        vdouble u[4];
+        philox(block, photon, stream0, stream1, key0, key1, u);
+        block -= (vulong)active;
+        if(sequence != NULL) {
+            double draws[EVENT_DIMENSIONS][PACKET_WIDTH];
+            for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+                const int dimension = active[lane] ?
+                    std::min(eventDimension(numParameters, events[lane]), (int)SOBOL_DIMENSIONS) : SOBOL_DIMENSIONS;
+                for(int k = 0; k < EVENT_DIMENSIONS; k++) {
+                    draws[k][lane] = quasiDraws[lane][dimension + k];
+                }
+            }
+            for(int k = 0; k < EVENT_DIMENSIONS; k++) {
+                vdouble q;
+                memcpy(&q, draws[k], sizeof(q));
+                u[k] = q >= 0 ? q : u[k];
+            }
+        }
+
+        const vdouble normalZ = z < 0 ? splat(1.0) : splat(-1.0);
+        const vdouble cosI = vabs(z);
+
+        /* Absorption in the layer being crossed, with the cos freePathLength uses */
+        const vlong crossing = active & (thickness > 0);
+        const vdouble layer = crossing ? thickness / (disableSieve ? cosI : vcosSmall(cosI)) : splat(0);
+        const vlong absorbed = crossing & (u[0] > vexp(-absorption * layer));
+        depth += layer;
+
+        /* Fresnel, then reflection or refraction */
+        const vdouble n = n1 / n2;
+        const vdouble rootTerm = 1 - n*n*(1 - cosI*cosI);
+        const vdouble rooted = vsqrt(rootTerm > 0 ? rootTerm : splat(0));
+        const vdouble rs = (n1*cosI - n2*rooted) / (n1*cosI + n2*rooted);
+        const vdouble rp = (n1*rooted - n2*cosI) / (n1*rooted + n2*cosI);
+        const vdouble reflectance = rootTerm < 0 ? splat(1.0) : (rs*rs + rp*rp) / 2;
+        const vlong reflected = u[1] < reflectance;
+        vdouble next = reflected ? -z : z*n + normalZ*(n*cosI - rooted);
+        const vdouble perturbance = reflected ? perturbanceReflect : perturbanceRefract;
+
+        const vlong live = active & ~absorbed;
+        const vlong scattered = live & (perturbance != INFINITY);
+        if(any(scattered) && tabulated) {
+            for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+                if(scattered[lane]) {
+                    next[lane] = interfaceList.scatteringTable(perturbance[lane])->sampleZ(next[lane], u[2][lane], u[3][lane]);
+                }
+            }
+        } else if(any(scattered)) {
+            /* brakkeScatteringZ, with rejected lanes drawing a fresh block until all have accepted */
+            const vdouble vertical = vabs(next);
+            const vdouble horizontalSquared = 1 - next*next;
+            const vdouble horizontal = vsqrt(horizontalSquared > 0 ? horizontalSquared : splat(0));
+            const vdouble exponent = scattered ? 1 / (perturbance + 1) : splat(0);
+            vdouble projected = {};
+            vlong pending = scattered;
+            vdouble a = u[2], b = u[3];
+            while(true) {
+                const vdouble cp = vexp(exponent * vlog(a));
+                const vdouble spSquared = 1 - cp*cp;
+                const vdouble sp = vsqrt(spSquared > 0 ? spSquared : splat(0));
+                const vdouble attempt = sp*vcos2pi(b)*horizontal + cp*vertical;
+                projected = pending ? attempt : projected;
+                pending &= attempt < 0;
+                if(!any(pending)) {
+                    break;
+                }
+                vdouble retry[4];
+                philox(block, photon, stream0, stream1, key0, key1, retry);
+                block -= (vulong)pending;
+                a = retry[0];
+                b = retry[1];
+            }
+            next = scattered ? (next < 0 ? -projected : projected) : next;
+        }
+        z = live ? next : z;
+
+        for(int lane = 0; lane < PACKET_WIDTH; lane++) {
+            if(!active[lane]) {
+                continue;
+            }
+            if(absorbed[lane]) {
+                tally.numAbsorbed++;
+            } else {
+                state[lane] = reflected[lane] ? reflectState[lane] : refractState[lane];
+                if(state[lane] == geometry.reflectedState) {
+                    tally.addReflected(weight[lane], depth[lane], events[lane]);
+                } else if(state[lane] == geometry.transmittedState) {
+                    tally.addTransmitted(weight[lane], depth[lane]);
+                } else {
+                    continue;
+                }
+            }
+            tally.events.add(events[lane]);
+            active[lane] = 0;
+        }
+    }
+    return tally;
+}
@@ -0,0 +1,275 @@
+#include <cmath>
+#include <algorithm>
+
+#include "abm_interfaces.h"
+#include "executor.h"
+#include "path_spectrum.h"
+#include "random_stream.h"
+#include "sample.h"
+#include "stratified_sampler.h"
+
+/* Depth bins: exact zero, below PATH_MIN_DEPTH, then PATH_BINS_PER_DECADE per decade up to an overflow bin */
+#define PATH_MIN_DEPTH 1e-9
+#define PATH_DECADES 9
+#define PATH_BINS_PER_DECADE 64
+#define PATH_NUM_BINS (3 + PATH_DECADES * PATH_BINS_PER_DECADE)
+
+PathTally::PathTally() : numTerminated(0) {
+    for(int exit = 0; exit < 2; exit++) {
+        counts[exit].resize(PATH_NUM_BINS);
+        weights[exit].resize(PATH_NUM_BINS);
+        depths[exit].resize(PATH_NUM_BINS);
+    }
+}
+
+int PathTally::bin(double depth) {
+    if(depth == 0) {
+        return 0;
+    } else if(depth < PATH_MIN_DEPTH) {
+        return 1;
+    }
+    const double x = log10(depth / PATH_MIN_DEPTH) * PATH_BINS_PER_DECADE;
+    return 2 + (int)std::min(x, (double)PATH_DECADES * PATH_BINS_PER_DECADE);
+}
+
+void PathTally::add(bool reflected, double depth, double weight) {
+    const int b = bin(depth);
+    counts[reflected][b]++;
+    weights[reflected][b] += weight;
+    depths[reflected][b] += weight * depth;
+}
+
+void PathTally::add(const PathTally &other) {
+    for(int exit = 0; exit < 2; exit++) {
+        for(int b = 0; b < PATH_NUM_BINS; b++) {
+            counts[exit][b] += other.counts[exit][b];
+            weights[exit][b] += other.weights[exit][b];
+            depths[exit][b] += other.depths[exit][b];
+        }
+    }
+    numTerminated += other.numTerminated;
+}
+
+long PathTally::numSamples() const {
+    long n = numTerminated;
+    for(int exit = 0; exit < 2; exit++) {
+        for(int b = 0; b < PATH_NUM_BINS; b++) {
+            n += counts[exit][b];
+        }
+    }
+    return n;
+}
+
+ReflectPair PathTally::evaluate(double absorptionCoefficient) const {
+    double survived[2] = {0, 0};
+    for(int exit = 0; exit < 2; exit++) {
+        for(int b = 0; b < PATH_NUM_BINS; b++) {
+            if(counts[exit][b] == 0) {
+                continue;
+            }
+            const double depth = depths[exit][b] / weights[exit][b];
+            survived[exit] += weights[exit][b] * (absorptionCoefficient > 0 ? exp(-absorptionCoefficient * depth) : 1.0);
+        }
+    }
+    const long n = numSamples();
+    return ReflectPair(survived[1] / n, survived[0] / n);
+}
+
+ReflectPair PathTally::evaluateDerivative(double absorptionCoefficient) const {
+    double slope[2] = {0, 0};
+    for(int exit = 0; exit < 2; exit++) {
+        for(int b = 0; b < PATH_NUM_BINS; b++) {
+            if(counts[exit][b] == 0 || depths[exit][b] == 0) {
+                continue;
+            }
+            const double depth = depths[exit][b] / weights[exit][b];
+            slope[exit] -= depths[exit][b] * exp(-absorptionCoefficient * depth);
+        }
+    }
+    const long n = numSamples();
+    return ReflectPair(slope[1] / n, slope[0] / n);
+}
+
+struct PathTask {
+    int resultIndex;
+    int firstSample;
+    int numSamples;
+};
+
+class PathJob : public ExecutorJob {
+    public:
+        PathJob(ABMInterfaceListBuilder &builder, const Sample &sample, const SpectrumSettings &settings,
+                const std::vector<PathPoint> &points, const SpectralCoefficients &table, int numThreads) :
+            builder(builder),
+            sample(sample),
+            settings(settings),
+            points(points),
+            table(table),
+            workerLists(numThreads, (InterfaceList *)NULL)
+        {
+            if(settings.stratifiedGeometry || settings.antitheticGeometry) {
+                geometry.reserve(points.size());
+                for(size_t i = 0; i < points.size(); i++) {
+                    geometry.push_back(StratifiedSampler(settings.seed, settings.randomStream(points[i].wavelength),
+                            settings.stratifiedGeometry, settings.antitheticGeometry));
+                }
+            }
+        }
+
+        ~PathJob() {
+            for(size_t i = 0; i < workerLists.size(); i++) {
+                delete workerLists[i];
+            }
+        }
+
+        void add(int index, int numSamples, int chunkSize) {
+            for(int first = 0; first < numSamples; first += chunkSize) {
+                PathTask task;
+                task.resultIndex = index;
+                task.firstSample = first;
+                task.numSamples = std::min(chunkSize, numSamples - first);
+                tasks.push_back(task);
+            }
+            tallies.resize(tasks.size());
+        }
+
+        size_t size() const {
+            return tasks.size();
+        }
+
+        virtual void runTask(size_t taskIndex, int workerIndex) {
+            const PathTask &task = tasks[taskIndex];
+            // A unit coefficient makes each layer's optical depth its geometric depth
+            InterfaceList *&interfaces = workerLists[workerIndex];
+            builder.rebuildInterfaces(interfaces, sample, table, task.resultIndex, 1.0);
+            RandomStream rng(settings.seed, settings.randomStream(points[task.resultIndex].wavelength), task.firstSample);
+            interfaces->setParameterSampler(geometry.empty() ? NULL : &geometry[task.resultIndex]);
+            tallies[taskIndex] = runABMPaths(task.numSamples, settings.azimuthalAngle, settings.polarAngle,
+                    settings.disableSieve, *interfaces, rng, settings.rouletteEvents);
+        }
+
+        /* Adds every task's tally to its point */
+        void collect(std::vector<PathPoint> &points) const {
+            for(size_t i = 0; i < tasks.size(); i++) {
+                points[tasks[i].resultIndex].tally.add(tallies[i]);
+            }
+        }
+
+    private:
+        ABMInterfaceListBuilder &builder;
+        const Sample &sample;
+        const SpectrumSettings &settings;
+        const std::vector<PathPoint> &points;
+        const SpectralCoefficients &table;  /* at each point's wavelength */
+        std::vector<StratifiedSampler> geometry;    /* per point, when the geometry isn't drawn per photon */
+        std::vector<InterfaceList *> workerLists;   /* refilled for each task a worker runs */
+        std::vector<PathTask> tasks;
+        std::vector<PathTally> tallies;
+};
+
+/* Whether absorption-free photons walk the two lists alike: every side but the absorption matches */
+static bool sameWalk(const InterfaceList &a, const InterfaceList &b) {
+    if(a.size() != b.size()) {
+        return false;
+    }
+    for(size_t i = 0; i < 2*a.size(); i++) {
+        const InterfaceSide &x = a.sideTable()[i];
+        const InterfaceSide &y = b.sideTable()[i];
+        if(x.n1 != y.n1 || x.n2 != y.n2 || x.perturbanceReflect != y.perturbanceReflect ||
+                x.perturbanceRefract != y.perturbanceRefract || x.thickness != y.thickness ||
+                x.reflectState != y.reflectState || x.refractState != y.refractState) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<PathPoint> tracePathSpectrum(Executor &executor, ABMInterfaceListBuilder &builder,
+        const Sample &sample, const SpectrumSettings &settings) {
+    const int numWavelengths = settings.wavelengthEnd >= settings.wavelengthStart ?
+        (settings.wavelengthEnd - settings.wavelengthStart) / settings.step + 1 : 0;
+    std::vector<PathPoint> points(numWavelengths);
+    if(numWavelengths == 0) {
+        return points;
+    }
+
+    /*
+     * Without absorption a photon's walk depends on the wavelength only through
+     * the refractive indices, which the data gives to three decimals and so
+     * often repeats between neighbouring wavelengths. Paths are traced at the
+     * first wavelength of the range with each set of indices and reused, as
+     * they are, for every other one with the same.
+     */
+    std::vector<int> wavelengths(numWavelengths);
+    for(int i = 0; i < numWavelengths; i++) {
+        points[i].wavelength = settings.wavelengthStart + i*settings.step;
+        wavelengths[i] = points[i].wavelength;
+    }
+    SpectralCoefficients table;
+    builder.tabulate(sample, wavelengths, table);
+    std::vector<InterfaceList *> lists(numWavelengths);
+    std::vector<int> source(numWavelengths);
+    std::vector<int> traced;
+    for(int i = 0; i < numWavelengths; i++) {
+        lists[i] = builder.buildInterfaces(sample, table, i, 1.0);
+        source[i] = i;
+        for(size_t j = 0; j < traced.size(); j++) {
+            if(sameWalk(*lists[traced[j]], *lists[i])) {
+                source[i] = traced[j];
+                break;
+            }
+        }
+        if(source[i] == i) {
+            traced.push_back(i);
+        }
+    }
+    for(int i = 0; i < numWavelengths; i++) {
+        delete lists[i];
+    }
+
+    PathJob job(builder, sample, settings, points, table, executor.size());
+    const int numTraced = traced.size();
+    const int chunksPerWavelength = (4*executor.size() + numTraced - 1) / numTraced;
+    int chunkSize = settings.chunkSize > 0 ? settings.chunkSize :
+        (settings.numSamples + chunksPerWavelength - 1) / chunksPerWavelength;
+    for(int j = 0; j < numTraced; j++) {
+        job.add(traced[j], settings.numSamples, std::max(chunkSize, 1));
+    }
+    executor.run(job, job.size());
+    job.collect(points);
+    for(int i = 0; i < numWavelengths; i++) {
+        if(source[i] != i) {
+            points[i].tally = points[source[i]].tally;
+        }
+    }
+    return points;
+}
+
+std::vector<SpectrumPoint> evaluatePathSpectrum(const ABMInterfaceListBuilder &builder, const Sample &sample,
+        const std::vector<PathPoint> &paths) {
+    std::vector<SpectrumPoint> spectrum(paths.size());
+    std::vector<int> wavelengths(paths.size());
+    for(size_t i = 0; i < paths.size(); i++) {
+        wavelengths[i] = paths[i].wavelength;
+    }
+    SpectralCoefficients table;
+    builder.tabulate(sample, wavelengths, table);
+    for(size_t i = 0; i < paths.size(); i++) {
+        spectrum[i].wavelength = paths[i].wavelength;
+        spectrum[i].solved = true;
+        const double absorption = table.mesophyllAbsorption[i];
+        spectrum[i].solution = paths[i].tally.evaluate(absorption);
+        spectrum[i].solutionDerivative = paths[i].tally.evaluateDerivative(absorption);
+    }
+    return spectrum;
+}
+
+bool sameMorphology(const Sample &a, const Sample &b) {
+    return a.wholeLeafThickness == b.wholeLeafThickness &&
+        a.cuticleUndulationsAspectRatio == b.cuticleUndulationsAspectRatio &&
+        a.epidermisCellCapsAspectRatio == b.epidermisCellCapsAspectRatio &&
+        a.spongyCellCapsAspectRatio == b.spongyCellCapsAspectRatio &&
+        a.palisadeCellCapsAspectRatio == b.palisadeCellCapsAspectRatio &&
+        a.mesophyllFraction == b.mesophyllFraction &&
+        a.bifacial == b.bifacial;
+}
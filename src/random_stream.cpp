@@ -0,0 +1,44 @@
+#include <cstddef>
+
+#include "random_stream.h"
+
+RandomStream::RandomStream(uint64_t seed, uint64_t stream, uint32_t substream) {
+    reset(seed, stream, substream);
+}
+
+void RandomStream::reset(uint64_t seed, uint64_t stream, uint32_t substream) {
+    key[0] = (uint32_t)seed;
+    key[1] = (uint32_t)(seed >> 32);
+    /* counter[0] is the block index within the substream, counter[1] the substream
+       and counter[2..3] the stream */
+    counter[0] = 0;
+    counter[1] = substream;
+    counter[2] = (uint32_t)stream;
+    counter[3] = (uint32_t)(stream >> 32);
+    position = 4;
+    sobol = NULL;
+    sobolIndex = 0;
+}
+
+void RandomStream::refill() {
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for(int round = 0; round < PHILOX_ROUNDS; round++) {
+        const uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        const uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    buffer[0] = c0;
+    buffer[1] = c1;
+    buffer[2] = c2;
+    buffer[3] = c3;
+    position = 0;
+    counter[0]++;
+}
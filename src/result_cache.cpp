@@ -0,0 +1,165 @@
+#include <cerrno>
+#include <cstdio>
+#include <map>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "abm_interfaces.h"
+#include "content_hash.h"
+#include "result_cache.h"
+#include "sample.h"
+
+/* Bump whenever a change to the tracer alters which photons a key stands for */
+#define RESULT_CACHE_VERSION "abm-result-cache 2"
+
+ResultCache::ResultCache(const std::string &directory) : directory(directory), numStores(0) {
+    if(mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Warning, could not create cache directory '%s'\n", directory.c_str());
+    }
+}
+
+std::string ResultCache::key(const Sample &sample, const ABMInterfaceListBuilder &builder,
+        const SpectrumSettings &settings) const {
+    ContentHash hash;
+    hash.add(RESULT_CACHE_VERSION);
+    hash.add(builder.modelName());
+    hash.add(builder.dataChecksum());
+    hash.add((uint64_t)builder.scatteringLevels());
+
+    // Field by field, since the struct's padding isn't guaranteed to be zero
+    hash.add(sample.wholeLeafThickness);
+    hash.add(sample.cuticleUndulationsAspectRatio);
+    hash.add(sample.epidermisCellCapsAspectRatio);
+    hash.add(sample.spongyCellCapsAspectRatio);
+    hash.add(sample.palisadeCellCapsAspectRatio);
+    hash.add(sample.proteinConcentration);
+    hash.add(sample.celluloseConcentration);
+    hash.add(sample.linginConcentration);
+    hash.add(sample.chlorophyllAConcentration);
+    hash.add(sample.chlorophyllBConcentration);
+    hash.add(sample.carotenoidConcentration);
+    hash.add(sample.mesophyllFraction);
+    hash.add((uint64_t)sample.bifacial);
+
+    hash.add((uint64_t)settings.seed);
+    hash.add(settings.azimuthalAngle);
+    hash.add(settings.polarAngle);
+    hash.add((uint64_t)settings.disableSieve);
+    // Weighted tracers estimate differently from the rest, and the packet tracer draws its events
+    // from other Philox blocks; scalar and reduced trace the same photons
+    if(settings.tracer == TRACER_IMPLICIT) {
+        hash.add("implicit capture");
+    } else if(settings.tracer == TRACER_PACKET) {
+        hash.add("packet");
+    }
+    // Only the rare photons that reach the limit see it, so results from before it existed stay under the default
+    if(settings.rouletteEvents != DEFAULT_ROULETTE_EVENTS) {
+        hash.add((uint64_t)settings.rouletteEvents);
+    }
+    // Only when set, so results cached before the option existed keep their keys
+    if(settings.commonRandomNumbers) {
+        hash.add("common random numbers");
+    }
+    if(settings.stratifiedGeometry) {
+        hash.add("stratified geometry");
+    }
+    if(settings.antitheticGeometry) {
+        hash.add("antithetic geometry");
+    }
+
+    char text[17];
+    sprintf(text, "%016llx", (unsigned long long)hash.get());
+    return text;
+}
+
+std::string ResultCache::filename(const std::string &key) const {
+    return directory + "/" + key + ".tally";
+}
+
+bool ResultCache::read(const std::string &filename, std::vector<SpectrumPoint> &entries) const {
+    FILE *file = fopen(filename.c_str(), "r");
+    if(file == NULL) {
+        return false;
+    }
+    // Weighted tallies append their weight sums to the line
+    char line[512];
+    while(fgets(line, sizeof(line), file) != NULL) {
+        SpectrumPoint entry;
+        ReflectTally &tally = entry.tally;
+        const int fields = sscanf(line, "%d %ld %ld %ld %lf %lf %lf %lf %lf %lf", &entry.wavelength,
+                &tally.numReflected, &tally.numTransmitted, &tally.numAbsorbed, &tally.reflectedDepth,
+                &tally.transmittedDepth, &tally.reflectedWeight, &tally.transmittedWeight,
+                &tally.reflectedWeightSquares, &tally.transmittedWeightSquares);
+        if(fields != 6 && fields != 10) {
+            break;
+        }
+        tally.weighted = fields == 10;
+        if(!tally.weighted) {
+            // Lines of unweighted tallies leave out their weights, which are all 1
+            tally.reflectedWeight = tally.reflectedWeightSquares = tally.numReflected;
+            tally.transmittedWeight = tally.transmittedWeightSquares = tally.numTransmitted;
+        }
+        entries.push_back(entry);
+    }
+    fclose(file);
+    return true;
+}
+
+void ResultCache::load(const std::string &key, std::vector<SpectrumPoint> &spectrum) const {
+    std::vector<SpectrumPoint> entries;
+    if(!read(filename(key), entries)) {
+        return;
+    }
+    std::map<int, ReflectTally> cached;
+    for(size_t i = 0; i < entries.size(); i++) {
+        cached[entries[i].wavelength] = entries[i].tally;
+    }
+    for(size_t i = 0; i < spectrum.size(); i++) {
+        std::map<int, ReflectTally>::const_iterator entry = cached.find(spectrum[i].wavelength);
+        if(entry != cached.end()) {
+            spectrum[i].tally = entry->second;
+        }
+    }
+}
+
+void ResultCache::store(const std::string &key, const std::vector<SpectrumPoint> &spectrum) {
+    const std::string target = filename(key);
+
+    // Another process may have stored this key since it was loaded, so merge into what is there now
+    std::vector<SpectrumPoint> entries;
+    read(target, entries);
+    std::map<int, ReflectTally> merged;
+    for(size_t i = 0; i < entries.size(); i++) {
+        merged[entries[i].wavelength] = entries[i].tally;
+    }
+    for(size_t i = 0; i < spectrum.size(); i++) {
+        ReflectTally &tally = merged[spectrum[i].wavelength];
+        if(spectrum[i].tally.numSamples() >= tally.numSamples()) {
+            tally = spectrum[i].tally;
+        }
+    }
+
+    char suffix[64];
+    sprintf(suffix, ".%ld.%lu.tmp", (long)getpid(), __sync_fetch_and_add(&numStores, 1));
+    const std::string temporary = target + suffix;
+    FILE *file = fopen(temporary.c_str(), "w");
+    if(file == NULL) {
+        fprintf(stderr, "Warning, could not write cache file '%s'\n", temporary.c_str());
+        return;
+    }
+    for(std::map<int, ReflectTally>::const_iterator entry = merged.begin(); entry != merged.end(); entry++) {
+        const ReflectTally &tally = entry->second;
+        fprintf(file, "%d %ld %ld %ld %.17g %.17g", entry->first, tally.numReflected, tally.numTransmitted,
+                tally.numAbsorbed, tally.reflectedDepth, tally.transmittedDepth);
+        if(tally.weighted) {
+            fprintf(file, " %.17g %.17g %.17g %.17g", tally.reflectedWeight, tally.transmittedWeight,
+                    tally.reflectedWeightSquares, tally.transmittedWeightSquares);
+        }
+        fprintf(file, "\n");
+    }
+    if(fclose(file) != 0 || rename(temporary.c_str(), target.c_str()) != 0) {
+        fprintf(stderr, "Warning, could not write cache file '%s'\n", target.c_str());
+        unlink(temporary.c_str());
+    }
+}
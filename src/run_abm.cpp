@@ -1,24 +1,70 @@
 #include <utility>
 #include <cmath>
 #include <ctime>
+#include <cstring>
 #include <iostream>
 
 #include "abm_interfaces.h"
+#include "path_spectrum.h"
 #include "run_abm.h"
+#include "random_stream.h"
+#include "scattering_table.h"
 #include "vector.h"
 
-extern "C" {
-    #include "mt19937ar.h"
+double freePathLength(const vec3 &vector, const vec3 &normal, double cosI, double absorptionCoefficient, bool disableSieve,
+        RandomStream &rng, int dimension) {
+    if(disableSieve) {
+        return -(1/absorptionCoefficient) * log(rng.sample(dimension)) * cosI;
+    } else {
+        return -(1/absorptionCoefficient) * log(rng.sample(dimension)) * cos(cosI);
+    }
 }
 
-#define RANDOM_FUNCTION genrand_real2
+/* Depth a photon crossing a layer adds per unit absorption coefficient, with the same cos as freePathLength */
+static inline double layerDepth(double thickness, double cosI, bool disableSieve) {
+    return thickness / (disableSieve ? cosI : cos(cosI));
+}
 
-double freePathLength(const vec3 &vector, const vec3 &normal, double cosI, double absorptionCoefficient, bool disableSieve) {
-    if(disableSieve) {
-        return -(1/absorptionCoefficient) * log(RANDOM_FUNCTION()) * cosI;
-    } else {
-        return -(1/absorptionCoefficient) * log(RANDOM_FUNCTION()) * cos(cosI);
+/* Chance of surviving each roulette for outliving the tracer's rouletteEvents */
+#define EVENT_SURVIVAL 0.5
+
+/* Whether a photon beginning its events-th event plays the roulette */
+static inline bool rouletteEvent(int events, int rouletteEvents) {
+    return rouletteEvents > 0 && events > rouletteEvents && (events - 1) % rouletteEvents == 0;
+}
+
+/* The roulette itself: false when the photon is terminated, else its weight grows to compensate */
+static inline bool surviveRoulette(double &weight, RandomStream &rng) {
+    if(rng.uniform() >= EVENT_SURVIVAL) {
+        return false;
+    }
+    weight /= EVENT_SURVIVAL;
+    return true;
+}
+
+/*
+ * Event roulette, called as a photon begins its events-th event: once it has
+ * taken rouletteEvents events, and again after every rouletteEvents more, it
+ * survives with probability EVENT_SURVIVAL and has its weight divided by it.
+ * A photon past the limit is expected to take at most as many events again,
+ * and spacing the roulettes out keeps the weights, and so the variance, small.
+ * Photons below the limit draw nothing, so runs in which none reaches it are
+ * unaffected. Returns false when the photon is terminated.
+ */
+static inline bool surviveEvent(int events, int rouletteEvents, double &weight, ReflectTally &tally,
+        RandomStream &rng) {
+    if(!rouletteEvent(events, rouletteEvents)) {
+        return true;
+    }
+    if(events == rouletteEvents + 1) {
+        tally.weighted = true;
+        tally.events.numRouletted++;
     }
+    return surviveRoulette(weight, rng);
+}
+
+bool surviveEventRoulette(int events, int rouletteEvents, double &weight, ReflectTally &tally, RandomStream &rng) {
+    return surviveEvent(events, rouletteEvents, weight, tally, rng);
 }
 
 vec3 reflect(const vec3 &vector, const vec3 &normal, double cosI) {
@@ -56,128 +102,442 @@ vec3 perpendicular(const vec3 &vector) {
     } 
 }
 
-vec3 brakkeScattering(const vec3 &vector, double delta) {
-    vec3 perp = perpendicular(vector);
-    perp.Normalize();
-    const vec3 &w = vector;
-    const vec3 &u = perp;
-    const vec3 v = w.Cross(u);
+/*
+ * Perturbs vector by the Brakke lobe cos(polar)^delta around it, keeping the
+ * result on the same side of the interface plane. The frame is chosen so that
+ * only the vertical component decides acceptance, which costs one pow, sqrt and
+ * cos per attempt and at least half of all attempts succeed. With a table the
+ * sample is drawn without rejection. The first attempt takes sample dimensions
+ * dimension and dimension+1, any later ones draw from Philox.
+ */
+vec3 brakkeScattering(const vec3 &vector, double delta, const ScatteringTable *table, RandomStream &rng,
+        int dimension) {
+    const ScatteringFrame frame(vector);
+    double u = rng.sample(dimension);
+    double v = rng.sample(dimension + 1);
+    if(table != NULL) {
+        return table->sample(frame, u, v);
+    }
+
     const double exponent = 1/(delta+1);
+    double cp, sp, azimuthal, ca;
+    while(true) {
+        cp = pow(u, exponent);
+        sp = sqrt(1 - cp*cp);
+        azimuthal = 2*M_PI*v;
+        ca = cos(azimuthal);
+        if(sp*ca*frame.horizontal + cp*frame.vertical >= 0) {
+            break;
+        }
+        u = rng.uniform();
+        v = rng.uniform();
+    }
 
-    vec3 perturbed = -vector;
-    while(perturbed.z *  vector.z < 0) {
-        double polar = acos(pow(RANDOM_FUNCTION(), exponent));
-        double azimuthal = 2*M_PI*RANDOM_FUNCTION();
+    return frame.direction(cp, sp, ca, sin(azimuthal));
+}
 
-        double sp = sin(polar);
-        double sa = sin(azimuthal);
-        double cp = cos(polar);
-        double ca = cos(azimuthal);
+/*
+ * brakkeScattering reduced to the z it produces. Interface normals are all
+ * +-z, so a direction's z is all the rest of the trace depends on; in the
+ * scattering frame the result's z is the quantity the acceptance test already
+ * computes, so neither the frame nor sin(azimuth) is needed. Consumes the same
+ * draws as brakkeScattering.
+ */
+double brakkeScatteringZ(double z, double delta, const ScatteringTable *table, RandomStream &rng, int dimension) {
+    double u = rng.sample(dimension);
+    double v = rng.sample(dimension + 1);
+    if(table != NULL) {
+        return table->sampleZ(z, u, v);
+    }
 
-        perturbed = u * (sp*ca) + (v*sp*sa) + (w*cp);
+    const double vertical = fabs(z);
+    const double horizontal = ScatteringFrame::horizontalOf(z);
+    const double exponent = 1/(delta+1);
+    double cp, sp, projected;
+    while(true) {
+        cp = pow(u, exponent);
+        sp = sqrt(1 - cp*cp);
+        projected = sp*cos(2*M_PI*v)*horizontal + cp*vertical;
+        if(projected >= 0) {
+            break;
+        }
+        u = rng.uniform();
+        v = rng.uniform();
     }
 
-    return perturbed;
+    return z < 0 ? -projected : projected;
 }
 
-ReflectPair runABM(int nSamples, double azimuthalAngle, 
-        double polarAngle, bool disableSieve, InterfaceList &interfaceList) {
-    int startState;
-    int reflectedState;
-    int transmittedState;
-    int absorbedState = -2;
-    int numReflected   = 0;
-    int numTransmitted = 0;
-    int numAbsorbed    = 0;
+StartingGeometry startingGeometry(double azimuthalAngle, double polarAngle, int numInterfaces) {
+    StartingGeometry geometry;
 
     double sp = sin(polarAngle);
-    vec3 startingPosition(
+    geometry.direction = vec3(
         cos(azimuthalAngle)*sp,
         sin(azimuthalAngle)*sp,
         cos(polarAngle)
     );
 
-    startingPosition.z *= -1; /* Leaf interfaces are listed adaxial-first, 
-                                 orientation is generally assumed with respect to abaxial */
+    geometry.direction.z *= -1; /* Leaf interfaces are listed adaxial-first, 
+                                   orientation is generally assumed with respect to abaxial */
 
-    if(startingPosition.z < 0) {
-        startState = 0;
-        reflectedState = -1;
-        transmittedState = interfaceList.size();
+    if(geometry.direction.z < 0) {
+        geometry.startState = 0;
+        geometry.reflectedState = -1;
+        geometry.transmittedState = numInterfaces;
     } else {
-        startState = interfaceList.size() - 1;
-        reflectedState = startState + 1;
-        transmittedState = -1;
+        geometry.startState = numInterfaces - 1;
+        geometry.reflectedState = geometry.startState + 1;
+        geometry.transmittedState = -1;
     }
+    return geometry;
+}
+
+double firstSurfaceReflectance(const StartingGeometry &geometry, const InterfaceList &interfaceList) {
+    const vec3 &direction = geometry.direction;
+    const int dir = direction.z < 0 ? DIRECTION_DOWN : DIRECTION_UP;
+    const InterfaceSide &side = interfaceList.side(geometry.startState, dir);
+    const vec3 normal(0, 0, dir == DIRECTION_DOWN ? 1.0 : -1.0);
+    return fresnellCoefficient(direction, normal, -direction.Dot(normal), side.n1, side.n2);
+}
+
+ReflectTally runABM(int nSamples, double azimuthalAngle, 
+        double polarAngle, bool disableSieve, InterfaceList &interfaceList, RandomStream &rng, int rouletteEvents) {
+    const StartingGeometry geometry = startingGeometry(azimuthalAngle, polarAngle, interfaceList.size());
+    const vec3 &startingPosition = geometry.direction;
+    const int startState = geometry.startState;
+    const int reflectedState = geometry.reflectedState;
+    const int transmittedState = geometry.transmittedState;
+    const int absorbedState = -2;
+    ReflectTally tally;
+    tally.firstSurfaceReflectance = firstSurfaceReflectance(geometry, interfaceList);
+
+    const int numParameters = interfaceList.numSampleParameters();
 
     for(int i = 0; i < nSamples; i++) {
         vec3 direction(startingPosition);
         int state = startState;
-        interfaceList.prepareForSample();
+        double depth = 0;
+        double weight = 1;
+        int events = 0;
+        interfaceList.prepareForSample(rng);
 
         while(state != reflectedState && state != transmittedState && state != absorbedState) {
-            const ABMInterface &interface = interfaceList.getInterface(state);
-
-            double n1;
-            double n2;
-            double perturbanceReflect;
-            double perturbanceRefract;
-            int reflectState;
-            int refractState;
-            double thickness;
-            double absorption;
-            vec3 normal(0,0,0);
-
-            if(direction.z < 0) {
-                normal.z = 1.0;
-                n1 = interface.nAbove;
-                n2 = interface.nBelow;
-                perturbanceReflect = interface.perturbanceDownAbove;
-                perturbanceRefract = interface.perturbanceDownBelow;
-                refractState = state + 1;
-                reflectState = state - 1;
-                thickness    = interface.thicknessAbove;
-                absorption   = interface.absorptionAbove;
-            } else {
-                normal.z = -1.0;
-                n1 = interface.nBelow;
-                n2 = interface.nAbove;
-                perturbanceReflect = interface.perturbanceUpBelow;
-                perturbanceRefract = interface.perturbanceUpAbove;
-                reflectState = state + 1;
-                refractState = state - 1;
-                thickness  = interface.thicknessBelow;
-                absorption = interface.absorptionBelow;
+            if(!surviveEvent(++events, rouletteEvents, weight, tally, rng)) {
+                state = absorbedState;
+                break;
             }
+            const int dir = direction.z < 0 ? DIRECTION_DOWN : DIRECTION_UP;
+            const InterfaceSide &side = interfaceList.side(state, dir);
+
+            const double n1 = side.n1;
+            const double n2 = side.n2;
+            const double perturbanceReflect = side.perturbanceReflect;
+            const double perturbanceRefract = side.perturbanceRefract;
+            const int reflectState = side.reflectState;
+            const int refractState = side.refractState;
+            const double thickness  = side.thickness;
+            const double absorption = side.absorption;
+            const vec3 normal(0, 0, dir == DIRECTION_DOWN ? 1.0 : -1.0);
+            const int dimension = eventDimension(numParameters, events);
 
             double normalAngle = -direction.Dot(normal);
-            if(thickness > 0 && freePathLength(direction, normal, normalAngle, absorption, disableSieve) < thickness) {
+            if(thickness > 0 && freePathLength(direction, normal, normalAngle, absorption, disableSieve, rng,
+                    dimension + ABSORPTION_DIMENSION) < thickness) {
                 state = absorbedState;
                 break;
             } else {
-                if(RANDOM_FUNCTION() < fresnellCoefficient(direction, normal, normalAngle, n1, n2)) {
+                if(thickness > 0) {
+                    depth += layerDepth(thickness, normalAngle, disableSieve);
+                }
+                if(rng.sample(dimension + FRESNEL_DIMENSION) < fresnellCoefficient(direction, normal, normalAngle, n1, n2)) {
                     state = reflectState;
                     direction = reflect(direction, normal, normalAngle);
                     if(perturbanceReflect != INFINITY) {
-                        direction = brakkeScattering(direction, perturbanceReflect);
+                        direction = brakkeScattering(direction, perturbanceReflect,
+                                interfaceList.scatteringTable(perturbanceReflect), rng, dimension + SCATTERING_DIMENSION);
                     }
                 } else {
                     state = refractState;
                     direction = refract(direction, normal, normalAngle, n1, n2);
                     if(perturbanceRefract != INFINITY) {
-                        direction = brakkeScattering(direction, perturbanceRefract);
+                        direction = brakkeScattering(direction, perturbanceRefract,
+                                interfaceList.scatteringTable(perturbanceRefract), rng, dimension + SCATTERING_DIMENSION);
                     }
                 }
             }
         }
 
         if(state == reflectedState) {
-            numReflected++;
+            tally.addReflected(weight, depth, events);
         } else if(state == transmittedState) {
-            numTransmitted++;
+            tally.addTransmitted(weight, depth);
         } else {
-            numAbsorbed++;
+            tally.numAbsorbed++;
         }
+        tally.events.add(events);
+        rng.nextSubstream();
+    }
+    return tally;
+}
+
+/*
+ * Reduced-state tracer: the same walk as runABM, carrying only the interface
+ * state and the direction's z (minus the cosine of the polar angle).
+ * Reflection negates z, refraction maps it through Snell's law and scattering
+ * draws the new z directly. Photons consume the same draws as in runABM, so
+ * the two agree photon for photon up to rounding.
+ */
+ReflectTally runABMReduced(int nSamples, double azimuthalAngle,
+        double polarAngle, bool disableSieve, InterfaceList &interfaceList, RandomStream &rng, int rouletteEvents) {
+    const StartingGeometry geometry = startingGeometry(azimuthalAngle, polarAngle, interfaceList.size());
+    const int reflectedState = geometry.reflectedState;
+    const int transmittedState = geometry.transmittedState;
+    ReflectTally tally;
+    tally.firstSurfaceReflectance = firstSurfaceReflectance(geometry, interfaceList);
+
+    const int numParameters = interfaceList.numSampleParameters();
+
+    for(int i = 0; i < nSamples; i++) {
+        double z = geometry.direction.z;
+        int state = geometry.startState;
+        double depth = 0;
+        double weight = 1;
+        int events = 0;
+        interfaceList.prepareForSample(rng);
+
+        while(true) {
+            if(!surviveEvent(++events, rouletteEvents, weight, tally, rng)) {
+                tally.numAbsorbed++;
+                break;
+            }
+            const int dir = z < 0 ? DIRECTION_DOWN : DIRECTION_UP;
+            const InterfaceSide &side = interfaceList.side(state, dir);
+            const double normalZ = dir == DIRECTION_DOWN ? 1.0 : -1.0;
+            const double cosI = -z * normalZ;
+            const vec3 direction(0, 0, z);
+            const vec3 normal(0, 0, normalZ);
+            const int dimension = eventDimension(numParameters, events);
+
+            if(side.thickness > 0) {
+                if(freePathLength(direction, normal, cosI, side.absorption, disableSieve, rng,
+                        dimension + ABSORPTION_DIMENSION) < side.thickness) {
+                    tally.numAbsorbed++;
+                    break;
+                }
+                depth += layerDepth(side.thickness, cosI, disableSieve);
+            }
+
+            double perturbance;
+            if(rng.sample(dimension + FRESNEL_DIMENSION) < fresnellCoefficient(direction, normal, cosI, side.n1, side.n2)) {
+                state = side.reflectState;
+                z = -z;
+                perturbance = side.perturbanceReflect;
+            } else {
+                const double n = side.n1 / side.n2;
+                state = side.refractState;
+                z = z * n + normalZ * (n*cosI - sqrt(1 - n*n*(1 - cosI*cosI)));
+                perturbance = side.perturbanceRefract;
+            }
+            if(perturbance != INFINITY) {
+                z = brakkeScatteringZ(z, perturbance, interfaceList.scatteringTable(perturbance), rng,
+                        dimension + SCATTERING_DIMENSION);
+            }
+
+            if(state == reflectedState) {
+                tally.addReflected(weight, depth, events);
+                break;
+            } else if(state == transmittedState) {
+                tally.addTransmitted(weight, depth);
+                break;
+            }
+        }
+        tally.events.add(events);
+        rng.nextSubstream();
+    }
+    return tally;
+}
+
+/* Weight below which implicit-capture photons play Russian roulette, and their chance of surviving it */
+#define ROULETTE_WEIGHT 1e-4
+#define ROULETTE_SURVIVAL 0.1
+
+/*
+ * Implicit capture: the reduced-state walk, but a photon crossing an absorbing
+ * layer always survives and has its weight multiplied by the chance that it
+ * would have, exp(-absorption * thickness / cos) with the same cos as
+ * freePathLength. Photons whose weight falls below ROULETTE_WEIGHT survive
+ * with probability ROULETTE_SURVIVAL and have their weight divided by it, so
+ * the estimate stays unbiased. Reflectance and transmittance are the mean
+ * weight leaving each way; photons that lose the roulette count as absorbed.
+ */
+ReflectTally runABMImplicit(int nSamples, double azimuthalAngle,
+        double polarAngle, bool disableSieve, InterfaceList &interfaceList, RandomStream &rng, int rouletteEvents) {
+    const StartingGeometry geometry = startingGeometry(azimuthalAngle, polarAngle, interfaceList.size());
+    const int reflectedState = geometry.reflectedState;
+    const int transmittedState = geometry.transmittedState;
+    ReflectTally tally;
+    tally.firstSurfaceReflectance = firstSurfaceReflectance(geometry, interfaceList);
+    tally.weighted = true;
+
+    const int numParameters = interfaceList.numSampleParameters();
+
+    for(int i = 0; i < nSamples; i++) {
+        double z = geometry.direction.z;
+        int state = geometry.startState;
+        double depth = 0;
+        double weight = 1;
+        int events = 0;
+        interfaceList.prepareForSample(rng);
+
+        while(true) {
+            if(!surviveEvent(++events, rouletteEvents, weight, tally, rng)) {
+                tally.numAbsorbed++;
+                break;
+            }
+            const int dir = z < 0 ? DIRECTION_DOWN : DIRECTION_UP;
+            const InterfaceSide &side = interfaceList.side(state, dir);
+            const double normalZ = dir == DIRECTION_DOWN ? 1.0 : -1.0;
+            const double cosI = -z * normalZ;
+            const vec3 direction(0, 0, z);
+            const vec3 normal(0, 0, normalZ);
+            const int dimension = eventDimension(numParameters, events);
+
+            if(side.thickness > 0) {
+                const double layer = layerDepth(side.thickness, cosI, disableSieve);
+                depth += layer;
+                weight *= exp(-side.absorption * layer);
+                if(weight < ROULETTE_WEIGHT) {
+                    if(rng.uniform() >= ROULETTE_SURVIVAL) {
+                        tally.numAbsorbed++;
+                        break;
+                    }
+                    weight /= ROULETTE_SURVIVAL;
+                }
+            }
+
+            double perturbance;
+            if(rng.sample(dimension + FRESNEL_DIMENSION) < fresnellCoefficient(direction, normal, cosI, side.n1, side.n2)) {
+                state = side.reflectState;
+                z = -z;
+                perturbance = side.perturbanceReflect;
+            } else {
+                const double n = side.n1 / side.n2;
+                state = side.refractState;
+                z = z * n + normalZ * (n*cosI - sqrt(1 - n*n*(1 - cosI*cosI)));
+                perturbance = side.perturbanceRefract;
+            }
+            if(perturbance != INFINITY) {
+                z = brakkeScatteringZ(z, perturbance, interfaceList.scatteringTable(perturbance), rng,
+                        dimension + SCATTERING_DIMENSION);
+            }
+
+            if(state == reflectedState) {
+                tally.addReflected(weight, depth, events);
+                break;
+            } else if(state == transmittedState) {
+                tally.addTransmitted(weight, depth);
+                break;
+            }
+        }
+        tally.events.add(events);
+        rng.nextSubstream();
+    }
+    return tally;
+}
+
+/*
+ * Reduced-state walk without the absorption test. Each crossing of a layer
+ * adds its absorption * thickness / cos to the photon's depth instead, with
+ * the same cos as freePathLength, so the depth only needs scaling by the real
+ * coefficient if the list was built with a unit one. Without absorption only
+ * the event roulette ends photons trapped between interfaces; survivors
+ * carry its weight into the tally, so the paths stay unbiased.
+ */
+PathTally runABMPaths(int nSamples, double azimuthalAngle,
+        double polarAngle, bool disableSieve, InterfaceList &interfaceList, RandomStream &rng, int rouletteEvents) {
+    const StartingGeometry geometry = startingGeometry(azimuthalAngle, polarAngle, interfaceList.size());
+    PathTally tally;
+
+    const int numParameters = interfaceList.numSampleParameters();
+
+    for(int i = 0; i < nSamples; i++) {
+        double z = geometry.direction.z;
+        int state = geometry.startState;
+        double depth = 0;
+        double weight = 1;
+        int events = 0;
+        interfaceList.prepareForSample(rng);
+
+        while(true) {
+            if(rouletteEvent(++events, rouletteEvents) && !surviveRoulette(weight, rng)) {
+                tally.addTerminated();
+                break;
+            }
+            const int dir = z < 0 ? DIRECTION_DOWN : DIRECTION_UP;
+            const InterfaceSide &side = interfaceList.side(state, dir);
+            const double normalZ = dir == DIRECTION_DOWN ? 1.0 : -1.0;
+            const double cosI = -z * normalZ;
+            const vec3 direction(0, 0, z);
+            const vec3 normal(0, 0, normalZ);
+            const int dimension = eventDimension(numParameters, events);
+
+            if(side.thickness > 0) {
+                depth += side.absorption * layerDepth(side.thickness, cosI, disableSieve);
+            }
+
+            double perturbance;
+            if(rng.sample(dimension + FRESNEL_DIMENSION) < fresnellCoefficient(direction, normal, cosI, side.n1, side.n2)) {
+                state = side.reflectState;
+                z = -z;
+                perturbance = side.perturbanceReflect;
+            } else {
+                const double n = side.n1 / side.n2;
+                state = side.refractState;
+                z = z * n + normalZ * (n*cosI - sqrt(1 - n*n*(1 - cosI*cosI)));
+                perturbance = side.perturbanceRefract;
+            }
+            if(perturbance != INFINITY) {
+                z = brakkeScatteringZ(z, perturbance, interfaceList.scatteringTable(perturbance), rng,
+                        dimension + SCATTERING_DIMENSION);
+            }
+
+            if(state == geometry.reflectedState || state == geometry.transmittedState) {
+                tally.add(state == geometry.reflectedState, depth, weight);
+                break;
+            }
+        }
+        rng.nextSubstream();
+    }
+    return tally;
+}
+
+bool parseTracerMode(const char *name, TracerMode &mode) {
+    if(strcmp(name, "scalar") == 0) {
+        mode = TRACER_SCALAR;
+    } else if(strcmp(name, "packet") == 0) {
+        mode = TRACER_PACKET;
+    } else if(strcmp(name, "reduced") == 0) {
+        mode = TRACER_REDUCED;
+    } else if(strcmp(name, "implicit") == 0) {
+        mode = TRACER_IMPLICIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+ReflectTally runTracer(TracerMode mode, int nSamples, double azimuthalAngle,
+        double polarAngle, bool disableSieve, InterfaceList &interfaceList, RandomStream &rng, int rouletteEvents) {
+    switch(mode) {
+        case TRACER_PACKET:
+            return runABMPacket(nSamples, azimuthalAngle, polarAngle, disableSieve, interfaceList, rng, rouletteEvents);
+        case TRACER_IMPLICIT:
+            return runABMImplicit(nSamples, azimuthalAngle, polarAngle, disableSieve, interfaceList, rng, rouletteEvents);
+        case TRACER_REDUCED:
+            return runABMReduced(nSamples, azimuthalAngle, polarAngle, disableSieve, interfaceList, rng, rouletteEvents);
+        case TRACER_SCALAR:
+        default:
+            return runABM(nSamples, azimuthalAngle, polarAngle, disableSieve, interfaceList, rng, rouletteEvents);
     }
-    return ReflectPair((double)numReflected / nSamples, (double)numTransmitted / nSamples);
 }
@@ -148,3 +148,33 @@ int parseSampleFromFile(Sample *sample, FILE *inputFile) {
     
     return retval;
 }
+
+int parseSampleFromString(Sample *sample, const char *text, size_t length) {
+    yajl_handle hand;
+    ParseContext g;
+    g.sample = sample;
+
+    yajl_status stat;
+    yajl_parser_config cfg = { 1, 1 };
+    int retval = 1;
+
+    hand = yajl_alloc(&callbacks, &cfg, NULL, (void *) &g);
+
+    stat = yajl_parse(hand, (const unsigned char *) text, length);
+    if (stat == yajl_status_ok || stat == yajl_status_insufficient_data)
+        stat = yajl_parse_complete(hand);
+
+    if (stat != yajl_status_ok) {
+        unsigned char * str = yajl_get_error(hand, 1, (const unsigned char *) text, length);
+        fprintf(stderr, "%s", (const char *) str);
+        yajl_free_error(hand, str);
+        retval = 0;
+        if( stat == yajl_status_client_canceled) {
+            fprintf(stderr, "%s\n", g.lastError);
+        }
+    }
+
+    yajl_free(hand);
+
+    return retval;
+}
@@ -0,0 +1,134 @@
+#include <cmath>
+#include <algorithm>
+
+#include "scattering_table.h"
+
+vec3 perpendicular(const vec3 &vector);
+
+ScatteringFrame::ScatteringFrame(const vec3 &w) :
+    w(w),
+    vertical(fabs(w.z)),
+    horizontal(horizontalOf(w.z))
+{
+    if(horizontal > 1e-9) {
+        const double side = w.z < 0 ? -1.0 : 1.0;
+        e1 = vec3(-w.x*w.z, -w.y*w.z, 1 - w.z*w.z) * (side / horizontal);
+    } else {
+        // Axis is vertical: every direction in the lobe stays on its side
+        e1 = perpendicular(w);
+        e1.Normalize();
+    }
+    e2 = w.Cross(e1);
+}
+
+/* Fraction of azimuths around the axis that keep a direction at cos(theta) = mu on the axis' side */
+static double allowedArc(double mu, double vertical, double horizontal) {
+    const double sinTheta = sqrt(std::max(0.0, 1 - mu*mu));
+    if(mu >= horizontal || sinTheta * horizontal <= 0) {
+        return 1.0;
+    }
+    const double c = -mu * vertical / (sinTheta * horizontal);
+    return acos(std::max(-1.0, c)) / M_PI;
+}
+
+ScatteringTable::ScatteringTable(double delta, int levels) :
+    levels(levels),
+    inverse((levels + 1) * (levels + 1)),
+    arc((levels + 1) * (levels + 1))
+{
+    // Integrate in t = mu^(delta+1), the CDF of the untruncated lobe, where the density is just the allowed arc
+    const double exponent = 1/(delta+1);
+    const int steps = 8 * levels;
+    std::vector<double> cdf(steps + 1);
+
+    for(int row = 0; row <= levels; row++) {
+        const double vertical = (double)row / levels;
+        const double horizontal = sqrt(1 - vertical*vertical);
+
+        cdf[0] = 0;
+        double previous = allowedArc(0, vertical, horizontal);
+        for(int i = 1; i <= steps; i++) {
+            const double t = (double)i / steps;
+            const double current = allowedArc(pow(t, exponent), vertical, horizontal);
+            cdf[i] = cdf[i-1] + (previous + current) / (2 * steps);
+            previous = current;
+        }
+
+        int i = 0;
+        for(int level = 0; level <= levels; level++) {
+            const double target = cdf[steps] * level / levels;
+            while(i < steps - 1 && cdf[i+1] < target) {
+                i++;
+            }
+            const double span = cdf[i+1] - cdf[i];
+            const double f = span > 0 ? std::min(1.0, std::max(0.0, (target - cdf[i]) / span)) : 0;
+            const double mu = pow((i + f) / steps, exponent);
+            inverse[row * (levels + 1) + level] = mu;
+            arc[row * (levels + 1) + level] = allowedArc(mu, vertical, horizontal);
+        }
+    }
+}
+
+void ScatteringTable::draw(double vertical, double horizontal, double u, double v, double &mu, double &sinTheta,
+        double &psi, double &cosPsi) const {
+    const double x = vertical * levels;
+    const int row = std::min((int)x, levels - 1);
+    const double fx = x - row;
+    const double y = u * levels;
+    const int level = std::min((int)y, levels - 1);
+    const double fy = y - level;
+
+    const int index = row * (levels + 1) + level;
+    const float *m0 = &inverse[index];
+    const float *m1 = m0 + (levels + 1);
+    const float *a0 = &arc[index];
+    const float *a1 = a0 + (levels + 1);
+    mu = (1-fx) * ((1-fy)*m0[0] + fy*m0[1]) + fx * ((1-fy)*m1[0] + fy*m1[1]);
+    const double fraction = (1-fx) * ((1-fy)*a0[0] + fy*a0[1]) + fx * ((1-fy)*a1[0] + fy*a1[1]);
+
+    // Interpolation can widen the arc slightly; shrink it onto the exact arc so the result
+    // never leaves the axis' side and no azimuths pile up on its edge
+    sinTheta = sqrt(std::max(0.0, 1 - mu*mu));
+    psi = M_PI * fraction * (2*v - 1);
+    cosPsi = cos(psi);
+    if(sinTheta*cosPsi*horizontal + mu*vertical < 0) {
+        psi *= allowedArc(mu, vertical, horizontal) / fraction;
+        cosPsi = cos(psi);
+    }
+}
+
+vec3 ScatteringTable::sample(const ScatteringFrame &frame, double u, double v) const {
+    double mu, sinTheta, psi, cosPsi;
+    draw(frame.vertical, frame.horizontal, u, v, mu, sinTheta, psi, cosPsi);
+    return frame.direction(mu, sinTheta, cosPsi, sin(psi));
+}
+
+double ScatteringTable::sampleZ(double z, double u, double v) const {
+    const double vertical = fabs(z);
+    const double horizontal = ScatteringFrame::horizontalOf(z);
+    double mu, sinTheta, psi, cosPsi;
+    draw(vertical, horizontal, u, v, mu, sinTheta, psi, cosPsi);
+    // e1.z is horizontal on the axis' side and e2 is horizontal
+    return (z < 0 ? -1.0 : 1.0) * (sinTheta*cosPsi*horizontal + mu*vertical);
+}
+
+ScatteringTableSet::ScatteringTableSet(int levels) : levels(levels) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+ScatteringTableSet::~ScatteringTableSet() {
+    for(std::map<double, ScatteringTable *>::iterator it = tables.begin(); it != tables.end(); it++) {
+        delete it->second;
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+const ScatteringTable *ScatteringTableSet::get(double delta) {
+    pthread_mutex_lock(&mutex);
+    ScatteringTable *&table = tables[delta];
+    if(table == NULL) {
+        table = new ScatteringTable(delta, levels);
+    }
+    pthread_mutex_unlock(&mutex);
+    return table;
+}
@@ -0,0 +1,43 @@
+#include "simulator.h"
+
+Simulator::Simulator(const std::string &dataDirectory, int numThreads, int scatteringLevels) :
+    scatteringTables(scatteringLevels),
+    abmuBuilder(dataDirectory),
+    abmbBuilder(abmuBuilder),
+    executor(numThreads),
+    cache(NULL)
+{
+    if(scatteringLevels > 0) {
+        abmuBuilder.setScatteringTables(&scatteringTables);
+        abmbBuilder.setScatteringTables(&scatteringTables);
+    }
+}
+
+std::vector<SpectrumPoint> Simulator::simulate(const Sample &sample, ModelType model, const SpectrumSettings &settings) {
+    if(model == MODEL_ABMB) {
+        return runSpectrum(executor, abmbBuilder, sample, settings, cache);
+    }
+    return runSpectrum(executor, abmuBuilder, sample, settings, cache);
+}
+
+std::vector<PathPoint> Simulator::tracePaths(const Sample &sample, ModelType model, const SpectrumSettings &settings) {
+    if(model == MODEL_ABMB) {
+        return tracePathSpectrum(executor, abmbBuilder, sample, settings);
+    }
+    return tracePathSpectrum(executor, abmuBuilder, sample, settings);
+}
+
+std::vector<SpectrumPoint> Simulator::evaluatePaths(const Sample &sample, ModelType model,
+        const std::vector<PathPoint> &paths) {
+    // Both builders share the same spectra, and the coefficient doesn't depend on the model
+    return evaluatePathSpectrum(abmuBuilder, sample, paths);
+}
+
+void Simulator::simulateBatch(const std::vector<Sample> &samples, ModelType model, const SpectrumSettings &settings,
+        SpectrumSink &sink) {
+    if(model == MODEL_ABMB) {
+        runSpectra(executor, abmbBuilder, samples, settings, sink, cache);
+    } else {
+        runSpectra(executor, abmuBuilder, samples, settings, sink, cache);
+    }
+}
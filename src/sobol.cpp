@@ -0,0 +1,142 @@
+#include "sobol.h"
+
+/* Primitive polynomial degree s, its inner coefficients a and initial direction numbers m of each
+   dimension after the first, from Joe & Kuo's new-joe-kuo-6.21201 */
+struct SobolPolynomial {
+    int degree;
+    uint32_t coefficients;
+    uint32_t initial[7];
+};
+
+static const SobolPolynomial polynomials[SOBOL_DIMENSIONS - 1] = {
+    {1, 0,  {1}},
+    {2, 1,  {1, 3}},
+    {3, 1,  {1, 3, 1}},
+    {3, 2,  {1, 1, 1}},
+    {4, 1,  {1, 1, 3, 3}},
+    {4, 4,  {1, 3, 5, 13}},
+    {5, 2,  {1, 1, 5, 5, 17}},
+    {5, 4,  {1, 1, 5, 5, 5}},
+    {5, 7,  {1, 1, 7, 11, 19}},
+    {5, 11, {1, 1, 5, 1, 1}},
+    {5, 13, {1, 1, 1, 3, 11}},
+    {5, 14, {1, 3, 5, 5, 31}},
+    {6, 1,  {1, 3, 3, 9, 7, 49}},
+    {6, 13, {1, 1, 1, 15, 21, 21}},
+    {6, 16, {1, 3, 1, 13, 27, 49}},
+    {6, 19, {1, 1, 1, 15, 7, 5}},
+    {6, 22, {1, 3, 1, 15, 13, 25}},
+    {6, 25, {1, 1, 5, 5, 19, 61}},
+    {7, 1,  {1, 3, 7, 11, 23, 15, 103}},
+    {7, 4,  {1, 3, 7, 13, 13, 15, 69}},
+    {7, 7,  {1, 1, 3, 13, 7, 35, 63}},
+    {7, 8,  {1, 3, 5, 9, 1, 25, 53}},
+    {7, 14, {1, 3, 1, 13, 9, 35, 107}},
+    {7, 19, {1, 3, 1, 5, 27, 61, 31}},
+    {7, 21, {1, 1, 5, 11, 19, 41, 61}},
+    {7, 28, {1, 3, 5, 3, 3, 13, 69}},
+    {7, 31, {1, 1, 7, 13, 1, 19, 1}},
+    {7, 32, {1, 3, 7, 5, 13, 19, 59}},
+    {7, 37, {1, 1, 3, 9, 25, 29, 41}},
+    {7, 41, {1, 3, 5, 13, 23, 1, 55}},
+    {7, 42, {1, 3, 7, 3, 13, 59, 17}},
+};
+
+/* SplitMix64 finalizer, to spread (seed, stream, scramble, dimension) over the scramble seeds */
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+    x = ((x >> 8) & 0x00FF00FFU) | ((x & 0x00FF00FFU) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/*
+ * Laine-Karras style hash with Burley's constants. Each step only carries
+ * bits upwards, so on bit-reversed input every output bit depends only on the
+ * bits above it in the original: a nested uniform scramble. Adding a uniform
+ * seed first makes every output uniform. Takes and returns x bit-reversed.
+ */
+static uint32_t owenScrambleReversed(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * OWEN_M0;
+    x ^= x * OWEN_M1;
+    x ^= x * OWEN_M2;
+    x ^= x * OWEN_M3;
+    return x;
+}
+
+uint32_t SobolSequence::directions[SOBOL_DIMENSIONS][32];
+uint32_t SobolSequence::grayDirections[32][SOBOL_DIMENSIONS];
+bool SobolSequence::directionsReady = SobolSequence::fillDirections();
+
+bool SobolSequence::fillDirections() {
+    // The first dimension is the van der Corput sequence
+    for(int k = 0; k < 32; k++) {
+        directions[0][k] = 1U << (31 - k);
+    }
+    for(int d = 1; d < SOBOL_DIMENSIONS; d++) {
+        const SobolPolynomial &polynomial = polynomials[d - 1];
+        const int s = polynomial.degree;
+        uint32_t *v = directions[d];
+        for(int k = 0; k < s; k++) {
+            v[k] = polynomial.initial[k] << (31 - k);
+        }
+        for(int k = s; k < 32; k++) {
+            v[k] = v[k - s] ^ (v[k - s] >> s);
+            for(int i = 1; i < s; i++) {
+                v[k] ^= ((polynomial.coefficients >> (s - 1 - i)) & 1) * v[k - i];
+            }
+        }
+    }
+
+    for(int d = 0; d < SOBOL_DIMENSIONS; d++) {
+        for(int k = 0; k < 32; k++) {
+            grayDirections[k][d] = reverseBits(directions[d][k]);
+        }
+    }
+    return true;
+}
+
+SobolSequence::SobolSequence(uint64_t seed, uint64_t stream, uint32_t scramble) {
+    const uint64_t base = mix(mix(mix(seed) ^ stream) ^ scramble);
+    for(int d = 0; d < SOBOL_DIMENSIONS; d++) {
+        scrambleSeeds[d] = (uint32_t)(mix(base ^ d) >> 32);
+    }
+}
+
+double SobolSequence::sample(uint32_t index, int dimension) const {
+    const uint32_t *v = directions[dimension];
+    uint32_t x = 0;
+    for(int k = 0; index != 0; index >>= 1, k++) {
+        if(index & 1) {
+            x ^= v[k];
+        }
+    }
+    return scramble(reverseBits(x), dimension);
+}
+
+void SobolSequence::grayPoint(uint32_t index, uint32_t point[SOBOL_DIMENSIONS]) const {
+    const uint32_t gray = index ^ (index >> 1);
+    for(int d = 0; d < SOBOL_DIMENSIONS; d++) {
+        point[d] = 0;
+    }
+    for(int k = 0; k < 32; k++) {
+        if((gray >> k) & 1) {
+            for(int d = 0; d < SOBOL_DIMENSIONS; d++) {
+                point[d] ^= grayDirections[k][d];
+            }
+        }
+    }
+}
+
+double SobolSequence::scramble(uint32_t coordinate, int dimension) const {
+    return reverseBits(owenScrambleReversed(coordinate, scrambleSeeds[dimension])) * (1.0 / 4294967296.0);
+}
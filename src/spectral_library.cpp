@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "content_hash.h"
+#include "spectral_library.h"
+
+/* Hash of everything after the header, as writeSpectralLibrary lays it out */
+static uint64_t checksum(const SpectralLibraryEntry *entries, const double *values, uint32_t numSeries,
+        uint32_t count) {
+    ContentHash hash;
+    hash.add(entries, numSeries * sizeof(SpectralLibraryEntry));
+    hash.add(values, (size_t)numSeries * count * sizeof(double));
+    return hash.get();
+}
+
+/* A file mapped by open(), with the identity it had then */
+struct MappedLibrary {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t modified;
+    const SpectralLibraryHeader *header;
+};
+
+/*
+ * Every mapping of the process, by filename, so that each simulator built on
+ * the same library shares one. Mappings are never unmapped: one replaced on
+ * disk is mapped again, and the old one stays for the data lists built on it.
+ */
+static std::map<std::string, MappedLibrary> mappedLibraries;
+static pthread_mutex_t mappedLibrariesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Maps and checks filename, recording its identity in library; NULL, after a warning unless it is missing, on failure */
+static const SpectralLibraryHeader *mapLibrary(const std::string &filename, MappedLibrary &library) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        if(errno != ENOENT) {
+            fprintf(stderr, "Warning, could not open spectral library '%s'\n", filename.c_str());
+        }
+        return NULL;
+    }
+    struct stat status;
+    void *mapping = MAP_FAILED;
+    if(fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(SpectralLibraryHeader)) {
+        mapping = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        fprintf(stderr, "Warning, could not map spectral library '%s'\n", filename.c_str());
+        return NULL;
+    }
+
+    const SpectralLibraryHeader *h = (const SpectralLibraryHeader *)mapping;
+    const size_t size = status.st_size;
+    const char *problem = NULL;
+    if(memcmp(h->magic, SPECTRAL_LIBRARY_MAGIC, sizeof(h->magic)) != 0) {
+        problem = "is not a spectral library";
+    } else if(h->byteOrder != SPECTRAL_LIBRARY_BYTE_ORDER || h->version != SPECTRAL_LIBRARY_VERSION) {
+        problem = "was written by another version or machine";
+    } else if(h->numSeries > size / sizeof(SpectralLibraryEntry) || h->count > size / sizeof(double) ||
+            size != sizeof(SpectralLibraryHeader) + h->numSeries * sizeof(SpectralLibraryEntry) +
+            (size_t)h->numSeries * h->count * sizeof(double)) {
+        problem = "is truncated";
+    }
+    const SpectralLibraryEntry *entries = (const SpectralLibraryEntry *)(h + 1);
+    const double *values = (const double *)(entries + (problem == NULL ? h->numSeries : 0));
+    if(problem == NULL && checksum(entries, values, h->numSeries, h->count) != h->checksum) {
+        problem = "fails its checksum";
+    }
+    if(problem != NULL) {
+        fprintf(stderr, "Warning, '%s' %s\n", filename.c_str(), problem);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    library.device = status.st_dev;
+    library.inode = status.st_ino;
+    library.size = status.st_size;
+    library.modified = status.st_mtime;
+    library.header = h;
+    return h;
+}
+
+bool SpectralLibrary::open(const std::string &filename) {
+    const SpectralLibraryHeader *h = NULL;
+    struct stat status;
+    pthread_mutex_lock(&mappedLibrariesMutex);
+    std::map<std::string, MappedLibrary>::const_iterator mapped = mappedLibraries.find(filename);
+    if(mapped != mappedLibraries.end() && stat(filename.c_str(), &status) == 0 &&
+            status.st_dev == mapped->second.device && status.st_ino == mapped->second.inode &&
+            status.st_size == mapped->second.size && status.st_mtime == mapped->second.modified) {
+        h = mapped->second.header;
+    } else {
+        MappedLibrary library;
+        h = mapLibrary(filename, library);
+        if(h != NULL) {
+            mappedLibraries[filename] = library;
+        }
+    }
+    pthread_mutex_unlock(&mappedLibrariesMutex);
+    if(h == NULL) {
+        return false;
+    }
+
+    header = h;
+    const SpectralLibraryEntry *entries = (const SpectralLibraryEntry *)(h + 1);
+    const double *values = (const double *)(entries + h->numSeries);
+    series.clear();
+    for(uint32_t i = 0; i < h->numSeries; i++) {
+        SpectralSeries s;
+        s.name = std::string(entries[i].name, strnlen(entries[i].name, sizeof(entries[i].name)));
+        s.units = std::string(entries[i].units, strnlen(entries[i].units, sizeof(entries[i].units)));
+        s.values = values + (size_t)i * h->count;
+        series.push_back(s);
+    }
+    return true;
+}
+
+const double *SpectralLibrary::find(const std::string &name) const {
+    for(size_t i = 0; i < series.size(); i++) {
+        if(series[i].name == name) {
+            return series[i].values;
+        }
+    }
+    return NULL;
+}
+
+bool writeSpectralLibrary(const std::string &filename, const std::vector<SpectralSeries> &series,
+        uint32_t count, uint32_t start, uint32_t step) {
+    std::vector<SpectralLibraryEntry> entries(series.size());
+    std::vector<double> values;
+    for(size_t i = 0; i < series.size(); i++) {
+        if(series[i].name.size() >= sizeof(entries[i].name) || series[i].units.size() >= sizeof(entries[i].units)) {
+            fprintf(stderr, "Series name or units too long: '%s'\n", series[i].name.c_str());
+            return false;
+        }
+        memset(&entries[i], 0, sizeof(entries[i]));
+        strcpy(entries[i].name, series[i].name.c_str());
+        strcpy(entries[i].units, series[i].units.c_str());
+        values.insert(values.end(), series[i].values, series[i].values + count);
+    }
+
+    SpectralLibraryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPECTRAL_LIBRARY_MAGIC, sizeof(header.magic));
+    header.version = SPECTRAL_LIBRARY_VERSION;
+    header.byteOrder = SPECTRAL_LIBRARY_BYTE_ORDER;
+    header.numSeries = series.size();
+    header.count = count;
+    header.start = start;
+    header.step = step;
+    header.checksum = checksum(entries.empty() ? NULL : &entries[0], values.empty() ? NULL : &values[0],
+            header.numSeries, count);
+
+    // Processes that have the old file mapped keep it; a rename never leaves them a partial one
+    char suffix[32];
+    sprintf(suffix, ".%ld.tmp", (long)getpid());
+    const std::string temporary = filename + suffix;
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if(file == NULL) {
+        fprintf(stderr, "Error while opening '%s'\n", temporary.c_str());
+        return false;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    if(!entries.empty()) {
+        written = written && fwrite(&entries[0], sizeof(entries[0]), entries.size(), file) == entries.size();
+    }
+    if(!values.empty()) {
+        written = written && fwrite(&values[0], sizeof(double), values.size(), file) == values.size();
+    }
+    if(fclose(file) != 0 || !written || rename(temporary.c_str(), filename.c_str()) != 0) {
+        fprintf(stderr, "Error while writing '%s'\n", filename.c_str());
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,548 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <ctime>
+#include <pthread.h>
+
+#include "abm_interfaces.h"
+#include "executor.h"
+#include "markov_solver.h"
+#include "random_stream.h"
+#include "result_cache.h"
+#include "sample.h"
+#include "sobol.h"
+#include "spectrum.h"
+#include "stratified_sampler.h"
+
+/* Samples spent on every wavelength before the first standard error estimate */
+#define PILOT_SAMPLES 10000
+/* Samples traced first at every wavelength without event counts, to measure its cost per photon */
+#define COST_PILOT_SAMPLES 256
+/* Tasks per worker that rounds with predicted costs are cut into */
+#define COST_TASKS_PER_WORKER 16
+
+struct WorkTask {
+    int wavelength;
+    int resultIndex;
+    int firstSample;
+    int numSamples;
+    int scramble;       /* Sobol scramble the samples belong to, -1 for pseudo-random sampling */
+};
+
+struct WorkResult {
+    int firstTask;
+    int numTasks;
+    int tasksRemaining;
+};
+
+/* Seconds on a monotonic clock */
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/* Budget of a wavelength's next round given everything traced for it so far; 0 when it is final */
+static int nextBudget(const ReflectTally &tally, const SpectrumSettings &settings);
+
+/*
+ * Every (sample, wavelength) point of a run. Each round queues the points
+ * that still have a budget; the chunk that completes a point decides its
+ * next budget, and the point that completes a sample hands it to the sink.
+ * With a cache, points start from the cached tallies and their photons
+ * carry on numbering from there. Deterministic runs solve each point in one
+ * task instead. Under quasi-Monte Carlo each point's samples are split into
+ * consecutive blocks, one per scramble, and no task spans two blocks.
+ * Samplers and scrambles are built per wavelength up front, and each worker
+ * refills one interface list of its own from the tables, so tasks allocate
+ * nothing.
+ *
+ * Photons cost roughly in proportion to the events they take, and that
+ * varies tenfold across a spectrum. Points that have no event counts yet
+ * trace a short pilot first. After that, each round queues its points
+ * longest-first by predicted events and cuts them into tasks of similar
+ * predicted cost, so the cheap tasks come last and fill in the gaps.
+ */
+class SpectrumJob : public ExecutorJob {
+    public:
+        SpectrumJob(ABMInterfaceListBuilder &builder, const std::vector<Sample> &samples, const SpectrumSettings &settings,
+                int numWavelengths, int numThreads, SpectrumSink &sink, ResultCache *cache) :
+            builder(builder),
+            samples(samples),
+            settings(settings),
+            numWavelengths(numWavelengths),
+            sink(sink),
+            cache(cache),
+            numThreads(numThreads),
+            points(samples.size() * numWavelengths),
+            coefficients(samples.size()),
+            budget(points.size()),
+            deferred(points.size(), 0),
+            roundPredicted(false),
+            results(points.size()),
+            wavelengthsRemaining(samples.size(), numWavelengths),
+            traced(samples.size(), false),
+            reportWavelengths(settings.verbose && samples.size() == 1),
+            scrambleSize(0),
+            solver(NULL),
+            workerLists(numThreads, (InterfaceList *)NULL)
+        {
+            pthread_mutex_init(&sinkMutex, NULL);
+            for(size_t i = 0; i < points.size(); i++) {
+                points[i].wavelength = settings.wavelengthStart + (i % numWavelengths)*settings.step;
+            }
+            std::vector<int> wavelengths(numWavelengths);
+            for(int k = 0; k < numWavelengths; k++) {
+                wavelengths[k] = points[k].wavelength;
+            }
+            for(size_t s = 0; s < samples.size(); s++) {
+                builder.tabulate(samples[s], wavelengths, coefficients[s]);
+            }
+            if(settings.solver == SOLVER_DETERMINISTIC) {
+                // Photon tallies don't apply, so there is nothing to cache
+                this->cache = NULL;
+                solver = new MarkovSolver(settings.solverBins);
+            } else if(settings.controlVariate) {
+                // Cached tallies don't keep the control's count
+                this->cache = NULL;
+                for(size_t i = 0; i < points.size(); i++) {
+                    points[i].controlVariate = true;
+                }
+            }
+            if(solver == NULL && settings.qmcScrambles > 0) {
+                // Cached photons belong to blocks of another size
+                this->cache = NULL;
+                scrambleSize = (settings.numSamples + settings.qmcScrambles - 1) / settings.qmcScrambles;
+                for(size_t i = 0; i < points.size(); i++) {
+                    points[i].scrambles.resize(settings.qmcScrambles);
+                }
+                sequences.reserve(numWavelengths * settings.qmcScrambles);
+                for(int k = 0; k < numWavelengths; k++) {
+                    for(int j = 0; j < settings.qmcScrambles; j++) {
+                        sequences.push_back(SobolSequence(settings.seed, settings.randomStream(wavelengths[k]), j));
+                    }
+                }
+            }
+            if(solver == NULL && (settings.stratifiedGeometry || settings.antitheticGeometry)) {
+                geometry.reserve(numWavelengths);
+                for(int k = 0; k < numWavelengths; k++) {
+                    geometry.push_back(StratifiedSampler(settings.seed, settings.randomStream(wavelengths[k]),
+                            settings.stratifiedGeometry, settings.antitheticGeometry));
+                }
+            }
+            if(this->cache != NULL) {
+                for(size_t s = 0; s < samples.size(); s++) {
+                    keys.push_back(cache->key(samples[s], builder, settings));
+                    std::vector<SpectrumPoint> spectrum = sampleSpectrum(s);
+                    cache->load(keys[s], spectrum);
+                    std::copy(spectrum.begin(), spectrum.end(), points.begin() + s*numWavelengths);
+                }
+            }
+            const bool adaptive = settings.targetStderr > 0 && scrambleSize == 0;
+            for(size_t i = 0; i < points.size(); i++) {
+                const ReflectTally &tally = points[i].tally;
+                if(solver != NULL) {
+                    budget[i] = 1;
+                } else if(!adaptive) {
+                    budget[i] = std::max(settings.numSamples - (int)tally.numSamples(), 0);
+                } else if(tally.numSamples() == 0) {
+                    budget[i] = std::min(settings.numSamples, PILOT_SAMPLES);
+                } else {
+                    budget[i] = nextBudget(tally, settings);
+                }
+            }
+            for(size_t s = 0; s < samples.size(); s++) {
+                if(numWavelengths == 0) {
+                    emit(s);
+                }
+            }
+            for(size_t i = 0; i < points.size(); i++) {
+                if(budget[i] <= 0) {
+                    finish(i);
+                }
+            }
+        }
+
+        ~SpectrumJob() {
+            for(size_t i = 0; i < workerLists.size(); i++) {
+                delete workerLists[i];
+            }
+            delete solver;
+            pthread_mutex_destroy(&sinkMutex);
+        }
+
+        /* Event counts of every photon traced so far */
+        EventStats eventStats() const {
+            EventStats stats;
+            for(size_t i = 0; i < points.size(); i++) {
+                stats.add(points[i].tally.events);
+            }
+            return stats;
+        }
+
+        /* Queues every point with a budget left; returns how many there are */
+        int beginRound() {
+            tasks.clear();
+            taskTallies.clear();
+            taskPredicted.clear();
+            taskSeconds.clear();
+            std::vector<std::pair<double, int> > order;
+            bool predicted = solver == NULL;
+            double totalCost = 0;
+            for(size_t i = 0; i < points.size(); i++) {
+                if(budget[i] <= 0) {
+                    continue;
+                }
+                const double cost = photonCost(i);
+                if(solver == NULL && cost == 0 && budget[i] > 2*COST_PILOT_SAMPLES) {
+                    deferred[i] = budget[i] - COST_PILOT_SAMPLES;
+                    budget[i] = COST_PILOT_SAMPLES;
+                }
+                predicted = predicted && cost > 0;
+                totalCost += cost * budget[i];
+                // Negated so that sorting puts the most expensive first; ties stay in wavelength order
+                order.push_back(std::make_pair(-cost * budget[i], (int)i));
+            }
+            const int active = order.size();
+            if(active == 0) {
+                return 0;
+            }
+            if(predicted) {
+                std::stable_sort(order.begin(), order.end());
+            }
+            roundPredicted = predicted;
+
+            //Split each point into chunks so that short spectral ranges still fill every thread
+            const int chunksPerPoint = (4*numThreads + active - 1) / active;
+            for(int k = 0; k < active; k++) {
+                const int i = order[k].second;
+                if(solver != NULL) {
+                    add(i, 0, 1, 1);
+                    continue;
+                }
+                int chunks = chunksPerPoint;
+                if(predicted) {
+                    // Tasks of similar predicted cost; coarse ones pack badly when only a few points are expensive
+                    chunks = (int)ceil(-order[k].first / (totalCost / (COST_TASKS_PER_WORKER*numThreads)));
+                }
+                int chunkSize = settings.chunkSize > 0 ? settings.chunkSize : (budget[i] + chunks - 1) / chunks;
+                add(i, points[i].tally.numSamples(), budget[i], std::max(chunkSize, 1));
+                traced[i / numWavelengths] = true;
+            }
+            return active;
+        }
+
+        /*
+         * With reportSchedule set, reports how well the round's predicted costs matched: predicted
+         * against traced events, the correlation of each task's predicted cost with its time
+         * (telling only when the predictions vary), and the share of the round (elapsed
+         * seconds) that workers spent idle.
+         */
+        void reportRound(double elapsed) const {
+            if(!settings.reportSchedule || !roundPredicted || tasks.empty()) {
+                return;
+            }
+            double predictedEvents = 0, tracedEvents = 0, busy = 0;
+            double cheapest = taskPredicted[0], dearest = taskPredicted[0];
+            double sp = 0, st = 0, spp = 0, stt = 0, spt = 0;
+            const double n = tasks.size();
+            for(size_t i = 0; i < tasks.size(); i++) {
+                const double p = taskPredicted[i], t = taskSeconds[i];
+                predictedEvents += p;
+                cheapest = std::min(cheapest, p);
+                dearest = std::max(dearest, p);
+                tracedEvents += taskTallies[i].events.numEvents;
+                busy += t;
+                sp += p;
+                st += t;
+                spp += p*p;
+                stt += t*t;
+                spt += p*t;
+            }
+            const double covariance = spt - sp*st/n;
+            const double spread = sqrt(std::max((spp - sp*sp/n) * (stt - st*st/n), 0.0));
+            fprintf(stderr, "Scheduled %lu tasks longest-first: predicted %.3g photon events, traced %.3g; "
+                    "tasks vary %.1fx, cost vs time r = %.2f; workers idle %.1f%% of %.2fs\n", (unsigned long)tasks.size(),
+                    predictedEvents, tracedEvents, dearest / cheapest, spread > 0 ? covariance / spread : 1.0,
+                    100 * std::max(1 - busy / (elapsed * numThreads), 0.0), elapsed);
+        }
+
+        size_t size() const {
+            return tasks.size();
+        }
+
+        virtual void runTask(size_t taskIndex, int workerIndex) {
+            const WorkTask &task = tasks[taskIndex];
+            const int sampleIndex = task.resultIndex / numWavelengths;
+            const int wavelengthIndex = task.resultIndex % numWavelengths;
+            InterfaceList *&interfaces = workerLists[workerIndex];
+            builder.rebuildInterfaces(interfaces, samples[sampleIndex], coefficients[sampleIndex], wavelengthIndex);
+            if(solver != NULL) {
+                SpectrumPoint &point = points[task.resultIndex];
+                point.solution = solver->solve(settings.azimuthalAngle, settings.polarAngle, settings.disableSieve,
+                        *interfaces);
+                point.solved = true;
+                if(settings.jacobian) {
+                    point.solutionDerivative = solveDerivative(interfaces, samples[sampleIndex],
+                            coefficients[sampleIndex], wavelengthIndex);
+                }
+                if(reportWavelengths) {
+                    fprintf(stderr, "Wavelength %d\t r:%f, t:%f, a:%f (solved)\n", task.wavelength,
+                            point.solution.first, point.solution.second, 1-(point.solution.first + point.solution.second));
+                }
+                budget[task.resultIndex] = 0;
+                finish(task.resultIndex);
+                return;
+            }
+            // Photons are numbered per wavelength so output doesn't depend on how a wavelength is split up
+            RandomStream rng(settings.seed, settings.randomStream(task.wavelength), task.firstSample);
+            interfaces->setParameterSampler(geometry.empty() ? NULL : &geometry[wavelengthIndex]);
+            if(task.scramble >= 0) {
+                // Each scramble's points start from 0; deeper draws stay on the photon's own substream
+                rng.useSobol(&sequences[wavelengthIndex*settings.qmcScrambles + task.scramble],
+                        task.firstSample - task.scramble*scrambleSize);
+            }
+            const double start = now();
+            taskTallies[taskIndex] = runTracer(settings.tracer, task.numSamples, settings.azimuthalAngle,
+                    settings.polarAngle, settings.disableSieve, *interfaces, rng, settings.rouletteEvents);
+            taskSeconds[taskIndex] = now() - start;
+
+            // The last chunk of a point to finish sees every other chunk's tally
+            WorkResult &result = results[task.resultIndex];
+            if(__sync_sub_and_fetch(&result.tasksRemaining, 1) == 0) {
+                SpectrumPoint &point = points[task.resultIndex];
+                ReflectTally &tally = point.tally;
+                for(int i = result.firstTask; i < result.firstTask + result.numTasks; i++) {
+                    tally.add(taskTallies[i]);
+                    if(tasks[i].scramble >= 0) {
+                        point.scrambles[tasks[i].scramble].add(taskTallies[i]);
+                    }
+                }
+                // A cost pilot isn't worth a line of its own; the rest of the budget follows
+                if(reportWavelengths && deferred[task.resultIndex] == 0) {
+                    const ReflectPair rt = point.reflectance();
+                    fprintf(stderr, "Wavelength %d\t r:%f, t:%f, a:%f (%ld samples)\n", task.wavelength,
+                            rt.first, rt.second, 1-(rt.first + rt.second), tally.numSamples());
+                }
+                budget[task.resultIndex] = deferred[task.resultIndex] > 0 ? deferred[task.resultIndex] :
+                    nextBudget(tally, settings);
+                deferred[task.resultIndex] = 0;
+                if(budget[task.resultIndex] == 0) {
+                    finish(task.resultIndex);
+                }
+            }
+        }
+
+    private:
+        /* The solver has no noise, so a central difference in the absorption coefficient is accurate;
+           refills interfaces, the worker's list, for each side of it */
+        ReflectPair solveDerivative(InterfaceList *&interfaces, const Sample &sample, const SpectralCoefficients &table,
+                size_t index) {
+            const double absorption = table.mesophyllAbsorption[index];
+            const double step = std::max(absorption * 1e-3, 1e-3);
+            const double low = std::max(absorption - step, 0.0);
+            const double high = absorption + step;
+            ReflectPair values[2];
+            const double absorptions[2] = {low, high};
+            for(int k = 0; k < 2; k++) {
+                builder.rebuildInterfaces(interfaces, sample, table, index, absorptions[k]);
+                values[k] = solver->solve(settings.azimuthalAngle, settings.polarAngle, settings.disableSieve, *interfaces);
+            }
+            return ReflectPair((values[1].first - values[0].first) / (high - low),
+                    (values[1].second - values[0].second) / (high - low));
+        }
+
+        /* Queues samples [firstSample, firstSample + numSamples) of points[index] */
+        void add(int index, int firstSample, int numSamples, int chunkSize) {
+            WorkResult &result = results[index];
+            result.firstTask = tasks.size();
+            const int end = firstSample + numSamples;
+            for(int first = firstSample; first < end; ) {
+                WorkTask task;
+                task.wavelength = points[index].wavelength;
+                task.resultIndex = index;
+                task.firstSample = first;
+                task.scramble = -1;
+                int last = std::min(first + chunkSize, end);
+                if(scrambleSize > 0) {
+                    task.scramble = first / scrambleSize;
+                    last = std::min(last, (task.scramble + 1) * scrambleSize);
+                }
+                task.numSamples = last - first;
+                tasks.push_back(task);
+                first = last;
+            }
+            result.numTasks = tasks.size() - result.firstTask;
+            result.tasksRemaining = result.numTasks;
+            taskTallies.resize(tasks.size());
+            const double cost = photonCost(index);
+            for(size_t i = result.firstTask; i < tasks.size(); i++) {
+                taskPredicted.push_back(cost * tasks[i].numSamples);
+            }
+            taskSeconds.resize(tasks.size());
+        }
+
+        /* Predicted cost of one more photon of points[index], in events; 0 before any are traced */
+        double photonCost(int index) const {
+            const EventStats &events = points[index].tally.events;
+            const long numPhotons = events.numPhotons();
+            return numPhotons > 0 ? (double)events.numEvents / numPhotons : 0;
+        }
+
+        /* points[index] won't be traced again */
+        void finish(int index) {
+            const int sampleIndex = index / numWavelengths;
+            if(__sync_sub_and_fetch(&wavelengthsRemaining[sampleIndex], 1) == 0) {
+                emit(sampleIndex);
+            }
+        }
+
+        std::vector<SpectrumPoint> sampleSpectrum(int sampleIndex) const {
+            return std::vector<SpectrumPoint>(points.begin() + sampleIndex*numWavelengths,
+                    points.begin() + (sampleIndex + 1)*numWavelengths);
+        }
+
+        void emit(int sampleIndex) {
+            std::vector<SpectrumPoint> spectrum = sampleSpectrum(sampleIndex);
+            if(cache != NULL && traced[sampleIndex]) {
+                cache->store(keys[sampleIndex], spectrum);
+            }
+            pthread_mutex_lock(&sinkMutex);
+            sink.sampleFinished(sampleIndex, spectrum);
+            pthread_mutex_unlock(&sinkMutex);
+        }
+
+        ABMInterfaceListBuilder &builder;
+        const std::vector<Sample> &samples;
+        const SpectrumSettings &settings;
+        const int numWavelengths;
+        SpectrumSink &sink;
+        ResultCache *cache;
+        std::vector<std::string> keys;
+        const int numThreads;
+        std::vector<SpectrumPoint> points;
+        std::vector<SpectralCoefficients> coefficients;    /* per sample, at every wavelength */
+        std::vector<int> budget;
+        std::vector<int> deferred;  /* budget held back until a point's cost pilot is in */
+        std::vector<WorkTask> tasks;
+        std::vector<ReflectTally> taskTallies;
+        std::vector<double> taskPredicted;  /* events */
+        std::vector<double> taskSeconds;
+        bool roundPredicted;                /* every task of the round had a predicted cost */
+        std::vector<WorkResult> results;
+        std::vector<int> wavelengthsRemaining;
+        std::vector<bool> traced;
+        const bool reportWavelengths;
+        int scrambleSize;   /* samples per Sobol scramble, 0 for pseudo-random sampling */
+        std::vector<SobolSequence> sequences;       /* every scramble of each wavelength, under quasi-Monte Carlo */
+        std::vector<StratifiedSampler> geometry;    /* per wavelength, when the geometry isn't drawn per photon */
+        MarkovSolver *solver;
+        std::vector<InterfaceList *> workerLists;   /* refilled for each task a worker runs */
+        pthread_mutex_t sinkMutex;
+};
+
+/* Variance of one sample of the larger-variance of R and T, as the estimate in use sees it */
+static double sampleVariance(const ReflectTally &tally, const SpectrumSettings &settings) {
+    if(settings.controlVariate) {
+        return std::max(tally.controlledReflectanceVariance(), tally.controlledTransmittanceVariance());
+    }
+    return std::max(tally.reflectanceVariance(), tally.transmittanceVariance());
+}
+
+/* Samples still needed for the larger of R's and T's standard errors to reach target */
+static int samplesToTarget(double variance, long numSamples, double target) {
+    return (int)std::min(ceil(variance / (target * target)), 2e9) - numSamples;
+}
+
+static int nextBudget(const ReflectTally &tally, const SpectrumSettings &settings) {
+    const int remaining = settings.numSamples - tally.numSamples();
+    const double variance = sampleVariance(tally, settings);
+    if(settings.targetStderr > 0 && settings.qmcScrambles == 0 && remaining > 0 &&
+            sqrt(variance / tally.numSamples()) > settings.targetStderr) {
+        // Aim slightly past the predicted need so a noisy estimate rarely costs an extra round
+        const int needed = samplesToTarget(variance, tally.numSamples(), settings.targetStderr);
+        return std::min(remaining, std::max(needed + needed / 20, PILOT_SAMPLES / 10));
+    }
+    return 0;
+}
+
+ReflectPair SpectrumPoint::standardError() const {
+    if(solved) {
+        return ReflectPair(0, 0);
+    }
+    // Photons of one scramble aren't independent, but the scrambles' estimates are
+    double sum[2] = {0, 0}, squares[2] = {0, 0};
+    int n = 0;
+    for(size_t s = 0; s < scrambles.size(); s++) {
+        if(scrambles[s].numSamples() == 0) {
+            continue;
+        }
+        const ReflectPair rt = controlVariate ? scrambles[s].controlledPair() : scrambles[s].pair();
+        sum[0] += rt.first;
+        sum[1] += rt.second;
+        squares[0] += rt.first * rt.first;
+        squares[1] += rt.second * rt.second;
+        n++;
+    }
+    if(n < 2 && controlVariate) {
+        return ReflectPair(sqrt(tally.controlledReflectanceVariance() / tally.numSamples()),
+                sqrt(tally.controlledTransmittanceVariance() / tally.numSamples()));
+    } else if(n < 2) {
+        return ReflectPair(tally.reflectanceStderr(), tally.transmittanceStderr());
+    }
+    double error[2];
+    for(int k = 0; k < 2; k++) {
+        error[k] = sqrt(std::max(squares[k] - sum[k]*sum[k]/n, 0.0) / (n - 1) / n);
+    }
+    return ReflectPair(error[0], error[1]);
+}
+
+bool parseSolverType(const char *name, SolverType &solver) {
+    if(strcmp(name, "monte-carlo") == 0) {
+        solver = SOLVER_MONTE_CARLO;
+    } else if(strcmp(name, "deterministic") == 0) {
+        solver = SOLVER_DETERMINISTIC;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void runSpectra(Executor &executor, ABMInterfaceListBuilder &builder, const std::vector<Sample> &samples,
+        const SpectrumSettings &settings, SpectrumSink &sink, ResultCache *cache) {
+    const int numWavelengths = settings.wavelengthEnd >= settings.wavelengthStart ?
+        (settings.wavelengthEnd - settings.wavelengthStart) / settings.step + 1 : 0;
+
+    // Each round traces every point's budget; adaptive runs then top up the ones short of the target
+    SpectrumJob job(builder, samples, settings, numWavelengths, executor.size(), sink, cache);
+    while(job.beginRound() > 0) {
+        const double start = now();
+        executor.run(job, job.size());
+        job.reportRound(now() - start);
+    }
+
+    const EventStats events = job.eventStats();
+    if(settings.verbose && events.numPhotons() > 0) {
+        fprintf(stderr, "Photon events: mean %.1f, 99.9%% at most %ld, longest %ld; %ld photons outlived %d and played roulette\n",
+                (double)events.numEvents / events.numPhotons(), events.quantileBound(0.999), events.maxEvents,
+                events.numRouletted, settings.rouletteEvents);
+    }
+}
+
+/* Keeps the one spectrum runSpectrum asks for */
+class SpectrumCollector : public SpectrumSink {
+    public:
+        virtual void sampleFinished(size_t sampleIndex, const std::vector<SpectrumPoint> &spectrum) {
+            this->spectrum = spectrum;
+        }
+
+        std::vector<SpectrumPoint> spectrum;
+};
+
+std::vector<SpectrumPoint> runSpectrum(Executor &executor, ABMInterfaceListBuilder &builder,
+        const Sample &sample, const SpectrumSettings &settings, ResultCache *cache) {
+    SpectrumCollector collector;
+    runSpectra(executor, builder, std::vector<Sample>(1, sample), settings, collector, cache);
+    return collector.spectrum;
+}
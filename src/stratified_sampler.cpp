@@ -0,0 +1,40 @@
+#include "random_stream.h"
+#include "stratified_sampler.h"
+
+/* Scramble of the strata, numbered apart from the --qmc scrambles so the two stay independent */
+#define STRATA_SCRAMBLE 0xFFFFFFFFU
+
+StratifiedSampler::StratifiedSampler(uint64_t seed, uint64_t stream, bool stratify, bool antithetic) :
+    seed(seed),
+    stream(stream),
+    stratify(stratify),
+    antithetic(antithetic),
+    sequence(seed, stream, STRATA_SCRAMBLE)
+{
+}
+
+void StratifiedSampler::draw(RandomStream &rng, int numParameters, double *u) const {
+    const uint32_t photon = rng.substream();
+    const bool second = antithetic && (photon & 1);
+    if(stratify) {
+        const uint32_t index = antithetic ? photon / 2 : photon;
+        for(int k = 0; k < numParameters; k++) {
+            u[k] = sequence.sample(index, k);
+        }
+    } else if(second) {
+        // Redraw what the first photon of the pair drew from its own stream
+        RandomStream first(seed, stream, photon - 1);
+        for(int k = 0; k < numParameters; k++) {
+            u[k] = first.sample(k);
+        }
+    } else {
+        for(int k = 0; k < numParameters; k++) {
+            u[k] = rng.sample(k);
+        }
+    }
+    if(second) {
+        for(int k = 0; k < numParameters; k++) {
+            u[k] = 1 - u[k];
+        }
+    }
+}